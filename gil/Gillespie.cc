@@ -32,8 +32,14 @@
 #include <vector>
 #include <string>
 #include <sys/types.h>
+#include <sys/stat.h>
 #include <unistd.h>
+#include <fcntl.h>
 #include <signal.h>
+#include <cfloat>
+#include <cmath>
+#include <algorithm>
+#include <cctype>
 using std::string;
 #include <unordered_map>
 #include <libgen.h>
@@ -42,7 +48,6 @@ using std::string;
 #include <tinyexpr.h>
 
 #include "Gillespie.hh"
-#include "Sched.hh"
 #include "Trace.hh"
 
 /**
@@ -57,6 +62,9 @@ static inline void dumpDefines()
     }
 }    
 
+static std::unordered_map<string, uint> rNumbers;
+static bool overrideAllowed;
+
 /**
  * Constructor
  */
@@ -66,14 +74,77 @@ Gillespie::Gillespie(
     : volume(0.0),
       runIdle(true),
       idleTick(0.3),
+      rateTick(0.001),
       preIterFunc(preIterFunc),
       twidth(9),
-      mwidth(7)
+      mwidth(7),
+      gilFileName(gilFileName),
+      t(0.0),
+      plotTime(0.0),
+      plotInterval(0.0),
+      stopTime(0.0),
+      monitoring(false),
+      threshold(-DBL_MAX),
+      monitorDelay(0.0),
+      monitorInitState(false),
+      thresholdReached(false),
+      ckptFileName(NULL),
+      ckptInterval(0.0),
+      lastCkptTime(0),
+      lastEventTime(-DBL_MAX),
+      profileUntil(-DBL_MAX),
+      checking(false),
+      propertyResult(-1),
+      activeStale(true),
+      reactionClocks(false),
+      out(stdout),
+      outputFormat(FORMAT_TEXT),
+      writer(NULL),
+      plainText(false),
+      averaging(false),
+      windowStart(0.0),
+      sparseDeadband(0),
+      sparseMaxGap(0.0),
+      ergodicBurnIn(0.0),
+      ergodicBatches(20),
+      steadyWindow(0.0),
+      steadyTol(0.0),
+      steadyNumBatches(8),
+      steadyRows(0),
+      eventLog(NULL),
+      estoreRun(0),
+      estoreNumRuns(1),
+      passagesLeft(0),
+      stopBelow(-DBL_MAX),
+      stopAbove(DBL_MAX)
 {
+    // Several instances may be created in turn; each starts with a clean
+    // slate of parse-time state.
+    //
+    defines.clear();
+    rNumbers.clear();
+    overrideAllowed = false;
+
+    rng.seedFromClock();
     uint numLines = readGilFile(gilFileName);
     verify(gilFileName, numLines);
     // dumpDefines();
 }        
+
+/**
+ * Destructor
+ */
+Gillespie::~Gillespie()
+{
+    delete writer;
+    for (auto &o : extraOutputs) {
+        fclose(o.fp);
+    }
+    for (auto e : expressions) {
+        te_free(e->expr);
+        delete e;
+    }
+}
     
 static uint factorial(uint n)
 {
@@ -143,11 +214,6 @@ static void evalArith(std::string &str, string fname, uint lineNum)
     // TRACE_DEBUG("str after  = %s", str.c_str());
 }
 
-/**
- * Greatest reactant cardinality across all the reactions
- */
-static uint maxK; // calculated by verify
-
 /**
  * The number of distinct combinations of k elements that can be
  * chosen from a set of size n
@@ -155,28 +221,247 @@ static uint maxK; // calculated by verify
 
 inline uint numCombinations(uint n, uint k)
 {
-    static uint maxN = 0;
-    
     if (k == 1) {
         return n;
+    } else if (n < k) {
+        return 0;
     } else {
-        if (n > maxN) {
-            Util::initBinom(maxN = 10 * n, maxK);
+        // Reactant cardinalities are small, so this is computed directly
+        // rather than from a table, which would have to be shared by the
+        // instances run on separate threads by forward flux sampling.
+        // Each product c is C(n - k + i, i), so the division is exact.
+        //
+        uint64_t c = 1;
+        for (uint i = 1; i <= k; i++) {
+            c = c * (n - k + i) / i;
+        }
+        return c;
+    }
+}
+
+
+/**
+ * Rebuild the list of reactions that are not fully inhibited. The
+ * others can't happen, and have a = 0 until they are re-enabled.
+ */
+void Gillespie::updateActiveReactions()
+{
+    activeReactions.clear();
+    for (uint i = 0; i < reactions.size(); i++) {
+        if (reactions[i].inhibition < 1.0) {
+            activeReactions.push_back(i);
+        } else {
+            reactions[i].a = 0.0;
+        }
+    }
+    activeStale = false;
+}
+
+double Gillespie::Profile::level(double t) const
+{
+    if (kind == EXP) {
+        return t < start || t >= end ? 0.0
+                                     : level0 * exp(-(t - start) / tau);
+    }
+    if (t < times[0]) {
+        return 0.0;
+    }
+    uint i = std::upper_bound(times.begin(), times.end(), t) - times.begin();
+    if (i == times.size()) {
+        return levels.back();
+    }
+    double f = (t - times[i - 1]) / (times[i] - times[i - 1]);
+    return levels[i - 1] + f * (levels[i] - levels[i - 1]);
+}
+
+double Gillespie::Profile::minLevel(double t0, double t1) const
+{
+    if (kind == EXP) {
+        // Decays from start on
+        return t0 < start ? 0.0 : level(t1);
+    }
+    if (t0 < times[0]) {
+        return 0.0;
+    }
+    double min = Util::min(level(t0), level(t1));
+    for (uint i = 0; i < times.size(); i++) {
+        if (times[i] > t0 && times[i] < t1) {
+            min = Util::min(min, levels[i]);
+        }
+    }
+    return min;
+}
+
+double Gillespie::Profile::windowEnd(double t) const
+{
+    if (kind == EXP) {
+        // Over tau / 8 the level drops by less than 12%
+        if (t < start) {
+            return start;
+        }
+        return t >= end ? DBL_MAX : Util::min(t + tau / 8.0, end);
+    }
+    if (t < times[0]) {
+        return times[0];
+    }
+    uint i = std::upper_bound(times.begin(), times.end(), t) - times.begin();
+    if (i == times.size()) {
+        return DBL_MAX;
+    }
+    if (levels[i] == levels[i - 1]) {
+        return times[i];
+    }
+    double end = t + (times[i] - times[i - 1]) / 8.0;
+    return end > t && end < times[i] ? end : times[i];
+}
+
+void Gillespie::updateProfileWindow()
+{
+    profileUntil = DBL_MAX;
+    for (auto &p : profiles) {
+        profileUntil = Util::min(profileUntil, p.windowEnd(t));
+    }
+    for (auto &r : reactions) {
+        if (r.profile >= 0) {
+            r.modFactor =
+                1.0 - profiles[r.profile].minLevel(t, profileUntil);
+            r.isDirty = true;
+        }
+    }
+}
+
+/**
+ * Compile an expression. Molecule ids in the expression stand for their
+ * counts, observable ids for their sums (taking precedence, as in the
+ * output), t for the time, and defines are replaced by their values. All
+ * other names must be tinyexpr functions or constants (exp, pow, ...)
+ */
+Gillespie::Expression *Gillespie::compileExpression(
+    const string &expr,
+    string fname,
+    uint lineNum)
+{
+    Expression *e = new Expression;
+    e->usesTime = false;
+
+    // tinyexpr only knows lower case names without dots, so give the
+    // molecules names of its own: mol_0, mol_1, ...
+    //
+    string &text = e->text;
+    for (uint i = 0; i < expr.size(); ) {
+        if (isdigit(expr[i]) || expr[i] == '.') {
+            uint j = i;
+            while (j < expr.size() && (isdigit(expr[j]) || expr[j] == '.')) {
+                j++;
+            }
+            if (j < expr.size() && (expr[j] == 'e' || expr[j] == 'E')) {
+                j++;
+                if (j < expr.size() && (expr[j] == '+' || expr[j] == '-')) {
+                    j++;
+                }
+                while (j < expr.size() && isdigit(expr[j])) j++;
+            }
+            text += expr.substr(i, j - i);
+            i = j;
+        } else if (isalpha(expr[i]) || expr[i] == '_') {
+            uint j = i;
+            while (j < expr.size() &&
+                   (isalnum(expr[j]) || expr[j] == '_' || expr[j] == '.'))
+            {
+                j++;
+            }
+            string name = expr.substr(i, j - i);
+            std::vector<std::pair<uint, uint>> terms;
+            uint o = observableIndex(name);
+            uint m = moleculeIndex(name);
+            if (o < observables.size()) {
+                terms = observables[o].terms;
+            } else if (m < molecules.size()) {
+                terms.push_back(std::make_pair(m, 1));
+            }
+            auto def = defines.find(name);
+            if (!terms.empty()) {
+                text += "(";
+                for (auto &term : terms) {
+                    uint v = std::find(e->molecules.begin(),
+                                       e->molecules.end(), term.first)
+                        - e->molecules.begin();
+                    if (v == e->molecules.size()) {
+                        e->molecules.push_back(term.first);
+                    }
+                    text += fmt::format("{}{} * mol_{}",
+                                        &term == &terms[0] ? "" : " + ",
+                                        term.second, v);
+                }
+                text += ")";
+            } else if (name == "t") {
+                e->usesTime = true;
+                text += name;
+            } else if (def != defines.end()) {
+                text += "(" + def->second + ")";
+            } else {
+                text += name;
+            }
+            i = j;
+        } else {
+            text += expr[i++];
         }
-        return Util::binom(n, k);
     }
+
+    // The values vector is not resized after this, so the addresses
+    // bound by te_compile stay valid.
+    //
+    uint numVars = e->molecules.size() + (e->usesTime ? 1 : 0);
+    e->values.resize(numVars);
+    std::vector<string> names;
+    std::vector<te_variable> vars;
+    for (uint v = 0; v < e->molecules.size(); v++) {
+        names.push_back(fmt::format("mol_{}", v));
+    }
+    if (e->usesTime) {
+        names.push_back("t");
+    }
+    for (uint v = 0; v < numVars; v++) {
+        te_variable var = { names[v].c_str(), &e->values[v], TE_VARIABLE,
+                            NULL };
+        vars.push_back(var);
+    }
+
+    int error;
+    e->expr = te_compile(text.c_str(), vars.data(), numVars, &error);
+    if (e->expr == NULL) {
+        fail(fname, lineNum, "Invalid expression (error at character {}): {}",
+             error, expr);
+    }
+    return e;
 }
 
+inline double Gillespie::evalExpression(Expression &e)
+{
+    uint v;
+    for (v = 0; v < e.molecules.size(); v++) {
+        e.values[v] = molecules[e.molecules[v]].getCount();
+    }
+    if (e.usesTime) {
+        e.values[v] = t;
+    }
+    return te_eval(e.expr);
+}
 
 /**
  * Calculate reaction probabilities (h and a values) for all
- * reactions.
+ * active reactions.
  * @return: cumulative probability a0
  */
 inline double Gillespie::calcReactProbs()
 {
+    if (activeStale) {
+        updateActiveReactions();
+    }
+
     double a0 = 0;
-    for (auto& r : reactions) {
+    for (auto i : activeReactions) {
+        Reaction &r = reactions[i];
         if (r.isDirty) {
             r.h = 1.0;
             for (uint m = 0; m < molecules.size(); m++) {
@@ -188,7 +473,15 @@ inline double Gillespie::calcReactProbs()
                 }
             }
             if (isPossible(r)) {
-                r.a = r.h * r.c * (1.0 - r.inhibition) ;
+                double rate = r.h * r.c;
+                if (r.rateLaw >= 0) {
+                    rate = evalExpression(*expressions[r.rateLaw]);
+                    if (!(rate >= 0.0)) {
+                        TRACE_FATAL("Rate law of reaction %s is %g at t = %g",
+                                    r.id.c_str(), rate, t);
+                    }
+                }
+                r.a = rate * (1.0 - r.inhibition) * r.modFactor;
             } else {
                 r.a = 0.0;
             }
@@ -207,67 +500,341 @@ inline double Gillespie::calcReactProbs()
  * (a) stopTime is reached, or
  * (b) no more reactions are possible and runIdle is false, or
  * (c) the count of a specified molecule passes through a specified
- *     threshold (from either direction.)
+ *     threshold (from either direction), or
+ * (d) a checked property is decided (see setProperty.)
  * 
  * @param plotInterval Time interval between molecule count outputs
  * @param stopTime Simulated time at which to stop unconditionally
- * @param monitorId Id of molecule to be monitored
+ * @param monitorId Id of molecule or observable to be monitored
  * @param threshold Stop when monitored molecule count reaches this value
  * @param monitorDelay Continue for this time interval after threshold
  *        reached
- * @param runIdle Keep running even if no reaction can run
+ * @param pauseTime Pause when the simulated time exceeds this value
  */
 void Gillespie::run(
     double plotInterval,
     double stopTime,
     const char *monitorId,
     double threshold,
-    double monitorDelay)
+    double monitorDelay,
+    double pauseTime)
 {
-    // Initialize the random number generator
-    //
-    Util::initRand();
+    this->plotInterval = plotInterval;
+    this->stopTime = stopTime;
+    this->threshold = threshold;
+    this->monitorDelay = monitorDelay;
 
     // Print header line 
-    string header = makeHeader(molecules);
-    fmt::print("{}\n", header);
+    header = makeHeader();
+    openWriter();
+    if (writer != NULL) {
+        setOutputCounts();
+        writer->writeHeader();
+    }
+    if (plainText) {
+        fmt::print(out, "{}\n", header);
+    }
 
     // Is monitored molecule initially above or below threshold?
     //
-    bool monitoring = false;
-    uint monitorIndex = 0;
-    bool monitorInitState = false;
-    bool thresholdReached = false;
+    monitoring = false;
+    monitor = OutputColumn();
+    monitorInitState = false;
+    thresholdReached = false;
 
     if (monitorId != NULL) {
         monitoring = true;
-        monitorIndex = moleculeIndex(monitorId);
-        if (monitorIndex == UINT_MAX) {
-            fmt::print("unknown molecule ({}) specified for monitoring",
-                       monitorId);
+        string errMsg;
+        if (!findColumn(monitorId, monitor, errMsg)) {
+            fmt::print("unknown molecule or observable ({}) specified for "
+                       "monitoring\n", monitorId);
             exit(1);
         }
-        monitorInitState = (molecules[monitorIndex].getCount() > threshold);
+        monitorInitState = (columnValue(monitor) > threshold);
         thresholdReached = false;
     }
 
-    double plotTime = 0.0; // When to plot next 
+    plotTime = 0.0;
+    t = 0.0;
+    profileUntil = -DBL_MAX;
+    propertyResult = -1;
+
+    // Reaction clocks start at 0, each with a stream of its own
+    //
+    if (reactionClocks) {
+        clockRngs.resize(reactions.size());
+        for (uint i = 0; i < reactions.size(); i++) {
+            clockRngs[i].setSeed((uint64_t) ldexp(rng.uniform(), 64));
+            reactions[i].clockTime = 0.0;
+            reactions[i].clockNext = clockRngs[i].exponential();
+        }
+    }
+
+    passageAbove.clear();
+    for (auto thresh : passageThresholds) {
+        passageAbove.push_back(passageValue() > thresh);
+    }
+    passageTimes.assign(passageThresholds.size(), DBL_MAX);
+    passagesLeft = passageThresholds.size();
+
+    // Conditions start out false, so those that are true initially
+    // fire at t = 0
+    //
+    pendingTriggers.clear();
+    for (uint i = 0; i < triggers.size(); i++) {
+        triggers[i].isTrue = false;
+        triggers[i].isPending = false;
+        touchTrigger(i);
+    }
+
+    windowStart = 0.0;
+    for (auto &m : molecules) {
+        m.resetMean(0.0);
+    }
+    steadyRows = 0;
+    steadySums.clear();
+    steadyBatches.clear();
+
+    simulate(pauseTime);
+}
+
+/**
+ * Add the current values of the output columns to the steady state
+ * detector. Rows are grouped into batches of steadyWindow time. The run
+ * is stationary when, for every column of the last steadyNumBatches
+ * batch means, both the difference between the means of the second and
+ * the first half and the least squares slope over all the batches, times
+ * half their number, are within steadyTol times the late mean plus the
+ * 95% bound of a t-test. The variance of a batch mean comes from the
+ * second half only, so that a drift which has died down there does not
+ * inflate the noise it is compared with. Only the rows after the last
+ * scheduled event, with constant profiles and rate laws, count.
+ * @return whether the run is stationary
+ */
+bool Gillespie::noteSteadyRow()
+{
+    uint numCols = outputColumns.size();
+    if (scheduler.peekNextTime() != DBL_MAX ||
+        (!profiles.empty() && profileUntil != DBL_MAX) ||
+        !timedReactions.empty())
+    {
+        steadyRows = 0;
+        steadySums.clear();
+        steadyBatches.clear();
+        return false;
+    }
+
+    steadySums.resize(numCols, 0.0);
+    for (uint c = 0; c < numCols; c++) {
+        steadySums[c] += averaging ? outputMeans[c] / 100.0 : outputValue(c);
+    }
+
+    uint batchRows = Util::max(1L, lround(steadyWindow / plotInterval));
+    if (++steadyRows < batchRows) {
+        return false;
+    }
+    for (uint c = 0; c < numCols; c++) {
+        steadyBatches.push_back(steadySums[c] / steadyRows);
+    }
+    steadyRows = 0;
+    steadySums.clear();
+
+    uint numBatches = steadyBatches.size() / numCols;
+    if (numBatches > steadyNumBatches) {
+        steadyBatches.erase(steadyBatches.begin(),
+                            steadyBatches.begin() + numCols);
+        numBatches--;
+    }
+    if (numBatches < steadyNumBatches) {
+        return false;
+    }
+    uint half = numBatches / 2;
+    double tq = Util::tQuantile(half - 1);
+    double sumXX = 0.0;
+    for (uint b = 0; b < numBatches; b++) {
+        double x = b - (numBatches - 1) / 2.0;
+        sumXX += x * x;
+    }
+    for (uint c = 0; c < numCols; c++) {
+        double early = 0.0, late = 0.0, sumXY = 0.0;
+        for (uint b = 0; b < half; b++) {
+            early += steadyBatches[b * numCols + c] / half;
+            late  += steadyBatches[(b + half) * numCols + c] / half;
+        }
+        for (uint b = 0; b < numBatches; b++) {
+            sumXY += (b - (numBatches - 1) / 2.0) *
+                     steadyBatches[b * numCols + c];
+        }
+        double slope = sumXY / sumXX;
+
+        // Variance of a batch mean over the late half, with half - 1
+        // degrees of freedom
+        //
+        double sumSq = 0.0;
+        for (uint b = half; b < numBatches; b++) {
+            double d = steadyBatches[b * numCols + c] - late;
+            sumSq += d * d;
+        }
+        double var = sumSq / (half - 1);
+
+        double tol = steadyTol * fabs(late);
+        if (fabs(late - early) > tol + tq * sqrt(2.0 * var / half) ||
+            fabs(slope) * half > tol + tq * sqrt(var / sumXX) * half)
+        {
+            return false;
+        }
+    }
+    return true;
+}
+
+/**
+ * Write the remaining output rows, up to stopTime, with the means of the
+ * output columns over the late half of the batches that showed the run
+ * to be stationary
+ */
+void Gillespie::writeSteadyRows()
+{
+    uint numCols = outputColumns.size();
+    uint numBatches = steadyBatches.size() / numCols;
+    uint half = numBatches / 2;
+    std::vector<double> means(numCols, 0.0);
+    for (uint b = half; b < numBatches; b++) {
+        for (uint c = 0; c < numCols; c++) {
+            means[c] += steadyBatches[b * numCols + c] / (numBatches - half);
+        }
+    }
+
+    for (; plotTime <= stopTime; plotTime += plotInterval) {
+        if (writer != NULL) {
+            for (uint c = 0; c < numCols; c++) {
+                writer->setCount(c, lround(averaging ? means[c] * 100.0
+                                                     : means[c]));
+            }
+            writer->writeRow(plotTime);
+            if (!plainText) {
+                continue;
+            }
+        }
+        fmt::print(out, "{:{}.4f}", plotTime, twidth);
+        for (uint c = 0; c < numCols; c++) {
+            if (averaging) {
+                fmt::print(out, "{:{}.2f}", lround(means[c] * 100.0) / 100.0,
+                           fwidths[c]);
+            } else {
+                fmt::print(out, "{:{}}", lround(means[c]), fwidths[c]);
+            }
+        }
+        fmt::print(out, "\n");
+    }
+}
+
+/**
+ * Checkpoint support: SIGTERM handler sets this flag
+ */
+static volatile sig_atomic_t termRequested = 0;
+
+static void onSigterm(int sig)
+{
+    termRequested = 1;
+}
+
+void Gillespie::setCheckpoint(const char *fileName, double interval)
+{
+    ckptFileName = fileName;
+    ckptInterval = interval;
+    lastCkptTime = time(NULL);
+
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = onSigterm;
+    sigemptyset(&sa.sa_mask);
+    sigaction(SIGTERM, &sa, NULL);
+}
+
+/**
+ * Run the simulation loop from the current state until stopTime
+ * is reached, no more reactions are possible, or, at the top of the
+ * loop, the time is past pauseTime.
+ */
+void Gillespie::simulate(double pauseTime)
+{
+    uint iterCount = 0;
 
-    double t = 0.0;
+    if (header.empty()) {
+        header = makeHeader();
+    }
+    if (writer == NULL) {
+        openWriter();
+    }
 
     while (t <= stopTime ) {
-        Sched::processEvents(t);
+        if (t > pauseTime) {
+            return;
+        }
+
+        // Write a checkpoint if due or requested. The state at the top of
+        // the loop is complete: resuming re-enters the loop right here.
+        //
+        if (ckptFileName != NULL) {
+            if (termRequested) {
+                writeCheckpoint(ckptFileName);
+                TRACE_INFO("SIGTERM: checkpoint written at t = %g", t);
+                exit(128 + SIGTERM);
+            }
+            if (ckptInterval > 0.0 && (++iterCount & 0x3ff) == 0) {
+                time_t now = time(NULL);
+                if (difftime(now, lastCkptTime) >= ckptInterval) {
+                    writeCheckpoint(ckptFileName);
+                    lastCkptTime = now;
+                }
+            }
+        }
+
+        if (scheduler.peekNextTime() <= t) {
+            processEvents(t);
+        }
+        lastEventTime = t;
+
+        if (!pendingTriggers.empty()) {
+            checkTriggers();
+        }
+
+        if (!profiles.empty() && t >= profileUntil) {
+            updateProfileWindow();
+        }
+        // Rate laws that read t are evaluated now, and held constant for
+        // the step, which is at most rateTick long
+        //
+        for (auto r : timedReactions) {
+            reactions[r].isDirty = true;
+        }
 
         // If the monitored molecule reached the threshold, arrange
         // to stop after the interval specified by monitorDdelay
         //
         if (monitoring && !thresholdReached) {
-            if ((molecules[monitorIndex].getCount() == threshold) ||
-                ((molecules[monitorIndex].getCount() > threshold) != 
+            uint v = columnValue(monitor);
+            if ((v == threshold) ||
+                ((v > threshold) != 
                  monitorInitState)) 
             {
                 stopTime = t + monitorDelay;
                 thresholdReached = true;
+                TRACE_INFO("%s reached %g at t = %g",
+                           monitor.id.c_str(), threshold, t);
+            }
+        }
+
+        // In first passage mode, stop as soon as all thresholds have
+        // been reached, and with bounds as soon as one is
+        //
+        if (passagesLeft > 0 && notePassages()) {
+            break;
+        }
+        if (stopBelow != -DBL_MAX || stopAbove != DBL_MAX) {
+            uint v = passageValue();
+            if (v <= stopBelow || v >= stopAbove) {
+                break;
             }
         }
 
@@ -288,85 +855,204 @@ void Gillespie::run(
         // Roll the dice to determine which reaction (r) will happen next
         // and the time interval (tau) until it happens.
         //
-        double r1 = 0.0, r2 = 0.0;
+        double e = 0.0, r2 = 0.0;
         double tau = 0.0;
         double sum = 0.0;
         int r = -1; // next reaction. -1 means none
         
-        if (a0 != 0.0) {
+        if (a0 != 0.0 && reactionClocks) {
+            // The next reaction is the one whose clock first reaches its
+            // next firing
+            //
+            tau = DBL_MAX;
+            for (auto i : activeReactions) {
+                Reaction &rr = reactions[i];
+                if (rr.a > 0.0) {
+                    double dt =
+                        std::max((rr.clockNext - rr.clockTime) / rr.a, 0.0);
+                    if (dt < tau) {
+                        tau = dt;
+                        r = i;
+                    }
+                }
+            }
+        } else if (a0 != 0.0) {
             // At least one reaction is possible
 
-            r1 = Util::randDouble(0.0, 1.0, true);
-            r2 = Util::randDouble(0.0, a0, true);
+            e = rng.exponential();
+            r2 = rng.uniform() * a0;
 
-            tau = 1.0 / a0 * log(1.0 / r1);
+            tau = e / a0;
             if(tau == 0.0) { // should be impossible!
-                fmt::print("a0={}, r1={}\n", a0, r1);
+                fmt::print("a0={}, e={}\n", a0, e);
                 TRACE_FATAL("Ouch!");
             }
                     
 
             sum = 0.0;
 
-            for (r = 0; r < (int) reactions.size() - 1; r++) {
-                if ((sum += reactions[r].a) >= r2) {
+            uint i;
+            for (i = 0; i < activeReactions.size() - 1; i++) {
+                if ((sum += reactions[activeReactions[i]].a) >= r2) {
                     break;
                 }
             }
+            r = activeReactions[i];
         }
 
         if (r == -1) {
             // No reaction was possible
             if (runIdle) {
                 tau = idleTick;
+            } else if (!profiles.empty() && profileUntil < DBL_MAX) {
+                // Unless a profile blocks reactions for now
+                for (auto i : activeReactions) {
+                    Reaction &rr = reactions[i];
+                    if (rr.profile >= 0 && rr.modFactor == 0.0 &&
+                        isPossible(rr))
+                    {
+                        tau = profileUntil - t;
+                        break;
+                    }
+                }
+            }
+        }
+
+        // With rate laws that read t, a step longer than rateTick, or
+        // none at all, does nothing but end after rateTick. The laws are
+        // then re-evaluated and the next step is drawn afresh, which the
+        // memoryless draw allows.
+        //
+        int selected = r;
+        bool capped = false;
+        if (!timedReactions.empty() &&
+            ((r == -1 && tau == 0.0) || tau > rateTick))
+        {
+            tau = rateTick;
+            r = -1;
+            capped = true;
+        }
+
+        // Modulated reactions: the propensities are upper bounds for the
+        // current profile window. A step that would leave the window does
+        // nothing but end it, and a modulated reaction is accepted with
+        // the probability of its actual propensity over the bound
+        // (thinning.) Either way the memoryless draw stays exact.
+        //
+        bool thinned = false;
+        bool windowEnded = false;
+        if (!profiles.empty()) {
+            if (t + tau >= profileUntil && tau > 0.0) {
+                r = -1;
+                thinned = windowEnded = true;
+            } else if (r >= 0 && reactions[r].profile >= 0) {
+                Reaction &rr = reactions[r];
+                double f = 1.0 - profiles[rr.profile].level(t + tau);
+                Rng &stream = reactionClocks ? clockRngs[r] : rng;
+                if (f < rr.modFactor && stream.uniform() * rr.modFactor >= f) {
+                    r = -1;
+                    thinned = true;
+                }
             }
         }
 
         // update t
         //
-        t += tau;
+        double stepStart = t;
+        t = windowEnded ? profileUntil : t + tau;
+
+        // The clocks run on by the step, and that of the reaction that
+        // was selected, thinned or not, moves on to its next firing
+        // unless the step ended before it
+        //
+        if (reactionClocks) {
+            for (auto i : activeReactions) {
+                reactions[i].clockTime += reactions[i].a * (t - stepStart);
+            }
+            if (selected >= 0 && !windowEnded && !capped) {
+                Reaction &rr = reactions[selected];
+                rr.clockTime = rr.clockNext;
+                rr.clockNext += clockRngs[selected].exponential();
+            }
+        }
+
+        // A checked property is decided by the state that held during
+        // this step, or from now on if nothing more can happen. The run
+        // stops as soon as it is.
+        //
+        if (checking && propertyResult < 0 &&
+            decideProperty(stepStart,
+                           r == -1 && !thinned && !capped && !runIdle
+                               ? DBL_MAX : t))
+        {
+            break;
+        }
 
         // Before updating the molecule counts, output the current counts
         // for any plot times that occurred during this simulation step.
         
         bool reactionPrinted = false;
+        bool steady = false;
 
-        for (; plotTime <= t && plotTime <= stopTime; plotTime += plotInterval)
+        // With a plot interval of 0, every simulation step is plotted
+        //
+        for (; plotTime <= t && plotTime <= stopTime;
+             plotTime = plotInterval > 0.0
+                 ? plotTime + plotInterval : nextafter(t, DBL_MAX))
         {
+            if (averaging) {
+                takeOutputMeans(plotTime);
+            }
+            if (steadyWindow > 0.0 && !steady) {
+                steady = noteSteadyRow();
+            }
+            if (writer != NULL) {
+                setOutputCounts();
+                writer->writeRow(plotTime);
+            }
+            if (!plainText) {
+                continue;
+            }
+
             if (TRACE_DEBUG1_IS_ON && plotTime > 0.0) {
-                fmt::print("{}\n", header);
+                fmt::print(out, "{}\n", header);
             }
 
-            fmt::print("{:{}.4f}", plotTime, twidth);
-            for (uint m = 0; m < molecules.size(); m++) {
-                fmt::print("{:{}}", molecules[m].getCount(), fwidths[m]);
+            fmt::print(out, "{:{}.4f}", plotTime, twidth);
+            for (uint c = 0; c < outputColumns.size(); c++) {
+                if (averaging) {
+                    fmt::print(out, "{:{}.2f}", outputMeans[c] / 100.0,
+                               fwidths[c]);
+                } else {
+                    fmt::print(out, "{:{}}", outputValue(c), fwidths[c]);
+                }
             }
                 
             if (!reactionPrinted) {
                 if (Trace::getTraceLevel() == Trace::TRACE_Debug) {
                     if (r >= 0) {
-                        fmt::print(" [{:{}}] {}",
+                        fmt::print(out, " [{:{}}] {}",
                                    reactions[r].id,
                                    rwidth,
                                    reactions[r].formula);
                     } else {
-                        fmt::print(" (no reaction)\n");
+                        fmt::print(out, " (no reaction)\n");
                     }
                 }
                 reactionPrinted = true;
             }
             
-            fmt::print("\n");
+            fmt::print(out, "\n");
                 
             if (r >= 0) {
                 if (TRACE_DEBUG1_IS_ON) {
-                    fmt::print("-----------------------------------\n");
+                    fmt::print(out, "-----------------------------------\n");
                     //          [r1](10.000,  0,    0.00)
-                    fmt::print("{:{}}   c         h     a\n", "", rwidth + 3);
+                    fmt::print(out, "{:{}}   c         h     a\n", "", rwidth + 3);
                     for (uint rr = 0; rr < reactions.size(); rr++) {
                         string s;
 
-                        fmt::print("[{:{}}]{}({:7.3f},{:5},{:8.2f}) ", 
+                        fmt::print(out, "[{:{}}]{}({:7.3f},{:5},{:8.2f}) ", 
                                    reactions[rr].id,
                                    rwidth,
                                    reactions[rr].recalc ? '*' : ' ',
@@ -389,7 +1075,7 @@ void Gillespie::run(
                                 s += molecules[m].id + " ";
                             }
                         }
-                        fmt::print("{:13} ---> ", s);
+                        fmt::print(out, "{:13} ---> ", s);
                         s = "";
                         bool firstProduct = true;
                         for (uint m = 0; m < molecules.size(); m++) {
@@ -407,21 +1093,32 @@ void Gillespie::run(
                                 s += molecules[m].id + " ";
                             }
                         }
-                        fmt::print("{}\n", s);
+                        fmt::print(out, "{}\n", s);
                     }
-                    fmt::print("-----------------------------------\n");
-                    fmt::print("R = [{:{}}] {}\n", 
+                    fmt::print(out, "-----------------------------------\n");
+                    fmt::print(out, "R = [{:{}}] {}\n", 
                                reactions[r].id.c_str(),
                                rwidth,
                                reactions[r].formula.c_str());
-                    fmt::print("===================================\n");
+                    fmt::print(out, "===================================\n");
                 }
             }
         }
 
+        if (steady) {
+            // The rest of the output is the stationary means
+            //
+            TRACE_INFO("Steady state at t = %g", t);
+            writeSteadyRows();
+            break;
+        }
+
         if (r != -1) {
             // A reaction happened: update molecule counts
             //
+            if (eventLog != NULL) {
+                eventLog->logReaction(t, r);
+            }
             for (uint m = 0; m < molecules.size(); m++) {
                 int delta = -reactions[r].left[m] + reactions[r].right[m];
                 if (delta != 0) {
@@ -434,7 +1131,7 @@ void Gillespie::run(
                     }
                 }
             }
-        } else {
+        } else if (!thinned && !capped) {
             // No reaction was possible
             //
             if (!runIdle) {
@@ -444,8 +1141,118 @@ void Gillespie::run(
         }
     }
 
-    if (TRACE_DEBUG1_IS_ON) {
-        fmt::print("t = {}.2f\n", t, twidth);
+    if (writer != NULL) {
+        if (eventLog != NULL) {
+            eventLog->setEndTime(std::min(t, stopTime));
+        }
+        writer->finish();
+    }
+    if (plainText && TRACE_DEBUG1_IS_ON) {
+        fmt::print(out, "t = {}.2f\n", t, twidth);
+    }
+}
+
+void Gillespie::addOutput(OutputFormat format, const char *fileName)
+{
+    FILE *fp = fopen(fileName, "w");
+    if (fp == NULL) {
+        perror(fileName);
+        exit(errno);
+    }
+    ExtraOutput o = { format, fp };
+    extraOutputs.push_back(o);
+}
+
+TrajIO::Writer *Gillespie::newRowWriter(
+    OutputFormat format,
+    FILE *fp,
+    const std::vector<string> &names)
+{
+    switch (format) {
+        case FORMAT_TEXT: {
+            if (header.empty()) {
+                header = makeHeader(); // sets fwidths
+            }
+            std::vector<uint> widths = { twidth };
+            widths.insert(widths.end(), fwidths.begin(), fwidths.end());
+            return new TrajIO::TextWriter(fp, names, plotInterval, widths,
+                                          averaging ? 2 : 0);
+        }
+        case FORMAT_BIN:
+            return new TrajIO::BinWriter(fp, names, plotInterval);
+        case FORMAT_DELTA:
+            return new TrajIO::DeltaWriter(fp, names, plotInterval);
+        case FORMAT_STATS:
+            return new TrajIO::StatsWriter(fp, names, plotInterval);
+        case FORMAT_SPARSE:
+            return new TrajIO::SparseWriter(fp, names, plotInterval,
+                                            sparseDeadband, sparseMaxGap);
+        case FORMAT_ERGODIC:
+            return new TrajIO::ErgodicWriter(fp, names, plotInterval,
+                                             ergodicBurnIn, stopTime,
+                                             ergodicBatches);
+        default:
+            return NULL;
+    }
+}
+
+void Gillespie::openWriter()
+{
+    std::vector<string> names = { "t" };
+    for (auto &c : outputColumns) {
+        names.push_back(c.id);
+    }
+    delete writer;
+    writer = NULL;
+    eventLog = NULL;
+    plainText = outputFormat == FORMAT_TEXT &&
+        Trace::getTraceLevel() <= Trace::TRACE_Debug;
+
+    if (outputFormat == FORMAT_EVENTS) {
+        // Effect of each reaction on each output column
+        //
+        std::vector<std::vector<int>> deltas;
+        for (auto &r : reactions) {
+            std::vector<int> d(outputColumns.size(), 0);
+            for (uint c = 0; c < outputColumns.size(); c++) {
+                for (auto &term : outputColumns[c].terms) {
+                    uint m = term.first;
+                    d[c] += ((int) r.right[m] - (int) r.left[m]) *
+                        (int) term.second;
+                }
+            }
+            deltas.push_back(d);
+        }
+        writer = eventLog =
+            new TrajIO::EventWriter(out, names, plotInterval, deltas);
+    } else if (outputFormat == FORMAT_ESTORE) {
+        // As many rows as the simulation loop produces up to stopTime
+        uint numTimes = 0;
+        for (double pt = 0.0; pt <= stopTime; pt += plotInterval) {
+            numTimes++;
+        }
+        writer = new TrajIO::EnsembleWriter(
+            estoreFile, estoreRun, estoreNumRuns, numTimes,
+            names, plotInterval);
+    } else {
+        std::vector<TrajIO::Writer *> sinks;
+        if (!plainText && outputFormat != FORMAT_NONE) {
+            sinks.push_back(newRowWriter(outputFormat, out, names));
+        }
+        for (auto &o : extraOutputs) {
+            sinks.push_back(newRowWriter(o.format, o.fp, names));
+        }
+        if (!sinks.empty()) {
+            writer = new TrajIO::AsyncWriter(sinks, names, plotInterval);
+        }
+    }
+}
+
+void Gillespie::setOutput(FILE *fp)
+{
+    out = fp;
+    if (writer != NULL) {
+        writer->setFile(fp);
     }
 }
 
@@ -558,11 +1365,173 @@ uint Gillespie::moleculeIndex(string id)
 }
 
 /**
- * Retrieve reaction index by id
+ * Retrieve observable index by id
  */
-uint Gillespie::reactionIndex(string id)
+uint Gillespie::observableIndex(string id)
 {
-    for (uint i = 0; i < reactions.size(); i++) {
+    for (uint i = 0; i < observables.size(); i++) {
+        if (Util::strCiEq(id, observables[i].id)) {
+            return i;
+        }
+    }
+    return UINT_MAX;
+}
+
+Gillespie::OutputColumn Gillespie::parseObservable(
+    const string &id,
+    const string &formula,
+    const char *fname,
+    uint lineNum)
+{
+    OutputColumn o;
+    o.id = id;
+
+    string errMsg;
+    std::vector<string> tokens = Util::tokenize(formula, " ", errMsg);
+    if (!errMsg.empty()) {
+        fail(fname, lineNum, "{}", errMsg);
+    }
+
+    // Terms, e.g. "2 A.P", separated by "+"
+    //
+    enum { WEIGHT, MOLECULE, OPERATOR } expect = WEIGHT;
+    uint weight = 1;
+    for (auto &token : tokens) {
+        switch (expect) {
+            case WEIGHT:
+                if (Util::isDigitsOnly(token)) {
+                    weight = strtoul(token.c_str(), NULL, 10);
+                    expect = MOLECULE;
+                    break;
+                } else {
+                    weight = 1;
+                    // fall thru to MOLECULE
+                }
+            case MOLECULE: {
+                uint m = moleculeIndex(token);
+                if (m >= molecules.size()) {
+                    fail(fname, lineNum, "Unknown molecule: {}", token);
+                }
+                o.terms.push_back(std::make_pair(m, weight));
+                expect = OPERATOR;
+                break;
+            }
+            case OPERATOR:
+                if (token != "+") {
+                    fail(fname, lineNum,
+                         "Expected '+', got '{}'", token);
+                }
+                expect = WEIGHT;
+                break;
+        }
+    }
+    if (expect != OPERATOR) {
+        fail(fname, lineNum, "Incomplete observable: {}", formula);
+    }
+    return o;
+}
+
+bool Gillespie::setPassage(
+    const string &id,
+    const std::vector<double> &thresholds,
+    string &errMsg)
+{
+    if (!findColumn(id, passage, errMsg)) {
+        return false;
+    }
+    passageThresholds = thresholds;
+    return true;
+}
+
+bool Gillespie::setBounds(
+    const string &id,
+    double low,
+    double high,
+    string &errMsg)
+{
+    if (!findColumn(id, passage, errMsg)) {
+        return false;
+    }
+    setBounds(low, high);
+    return true;
+}
+
+bool Gillespie::findColumn(
+    const string &id,
+    OutputColumn &col,
+    string &errMsg)
+{
+    std::vector<string> ids = { id };
+    std::vector<OutputColumn> columns = outputColumns;
+    if (!selectOutput(ids, errMsg)) {
+        return false;
+    }
+    col = outputColumns[0];
+    outputColumns = columns;
+    header.clear();
+    return true;
+}
+
+bool Gillespie::notePassages()
+{
+    uint v = passageValue();
+    for (uint i = 0; i < passageThresholds.size(); i++) {
+        if (passageTimes[i] == DBL_MAX &&
+            (v == passageThresholds[i] ||
+             (v > passageThresholds[i]) != passageAbove[i]))
+        {
+            passageTimes[i] = t;
+            passagesLeft--;
+        }
+    }
+    return passagesLeft == 0;
+}
+
+bool Gillespie::selectOutput(const std::vector<string> &ids, string &errMsg)
+{
+    std::vector<OutputColumn> columns;
+    if (ids.empty()) {
+        for (uint m = 0; m < molecules.size(); m++) {
+            uint o = observableIndex(molecules[m].id);
+            if (o < observables.size()) {
+                columns.push_back(observables[o]);
+            } else {
+                OutputColumn c = { molecules[m].id, { { m, 1 } } };
+                columns.push_back(c);
+            }
+        }
+        for (auto &o : observables) {
+            if (moleculeIndex(o.id) >= molecules.size()) {
+                columns.push_back(o);
+            }
+        }
+    } else {
+        for (auto &id : ids) {
+            uint o = observableIndex(id);
+            uint m = moleculeIndex(id);
+            if (o < observables.size()) {
+                columns.push_back(observables[o]);
+            } else if (m < molecules.size()) {
+                OutputColumn c = { molecules[m].id, { { m, 1 } } };
+                columns.push_back(c);
+            } else {
+                errMsg = fmt::format("unknown molecule or observable: {}",
+                                     id);
+                return false;
+            }
+        }
+    }
+    outputColumns = columns;
+    header.clear();
+    return true;
+}
+
+/**
+ * Retrieve reaction index by id
+ */
+uint Gillespie::reactionIndex(string id)
+{
+    for (uint i = 0; i < reactions.size(); i++) {
         if (Util::strCiEq(id, reactions[i].id)) {
             return i;
         }
@@ -574,8 +1543,6 @@ uint Gillespie::reactionIndex(string id)
 /**
  * Expand a wildcard (*) in a reaction ID
  */
-static std::unordered_map<string, uint> rNumbers;
-
 void Gillespie::expandReactionWildcard(string &id)
 {
     size_t pos = id.find('*');
@@ -627,55 +1594,141 @@ static std::vector<std::string> tokenizeString(
     return tokens;
 }
 
-/**
- * struct used to schedule setCount event
- */
-struct SetCountData {
-    Gillespie *g;
-    uint m;
-    uint count;
-    string comment;
-    SetCountData(Gillespie *g, uint m, uint count, string comment)
-        : g(g), m(m), count(count), comment(comment) {}
-};
+void Gillespie::processEvents(double now)
+{
+    scheduler.processEvents(now, [this, now](double time, const EventState &e) {
+        if (e.kind == EventState::SET_COUNT) {
+            setMoleculeCount(e.target, (uint) e.value);
+            logSetCount(now, e.target);
+        } else if (e.kind == EventState::SET_INHIB) {
+            setReactionInhibition(e.target, e.value);
+            logSetInhib(now, e.target, e.value);
+        } else {
+            setDrugInhibition(e.target, e.value);
+            for (auto r : drugs[e.target].reactions) {
+                logSetInhib(now, r, e.value);
+            }
+        }
+        if (e.repeats > 0) {
+            EventState next = e;
+            next.advance();
+            scheduler.schedule(next.time, next);
+        }
+    });
+}
 
-/**
- * Set a molecule count to a specified value
- * This function is called from the event scheduler.
- */
-static void setCount(
-    double stime, 
-    double now, 
-    SetCountData *data)
+uint Gillespie::compileCondition(
+    const string &cond,
+    uint &op,
+    string fname,
+    uint lineNum)
 {
-    data->g->setMoleculeCount(data->m, data->count);
-    delete data;
+    static const char *ops[] = { "<", "<=", ">", ">=", "==", "!=" };
+    size_t pos = cond.find_first_of("<>=!");
+    size_t len = pos + 1 < cond.size() && cond[pos + 1] == '=' ? 2 : 1;
+    string opStr = pos == string::npos ? "" : cond.substr(pos, len);
+    for (op = 0; op < 6 && opStr != ops[op]; op++);
+    if (op == 6 || cond.find_first_of("<>=!", pos + len) != string::npos) {
+        fail(fname, lineNum, "condition requires one comparison "
+             "(<, <=, >, >=, == or !=): {}", cond);
+    }
+    Expression *e = compileExpression(
+        "(" + cond.substr(0, pos) + ") - (" + cond.substr(pos + len) + ")",
+        fname, lineNum);
+    if (e->usesTime) {
+        fail(fname, lineNum, "a condition can only read molecule counts");
+    }
+    expressions.push_back(e);
+    return expressions.size() - 1;
 }
 
+bool Gillespie::conditionHolds(uint condition, uint op)
+{
+    double v = evalExpression(*expressions[condition]);
+    switch (op) {
+        case LT: return v <  0.0;
+        case LE: return v <= 0.0;
+        case GT: return v >  0.0;
+        case GE: return v >= 0.0;
+        case EQ: return v == 0.0;
+        default: return v != 0.0;
+    }
+}
 
-/**
- * struct used to schedule setInhib event
- */
-struct SetInhibData {
-    Gillespie *g;
-    uint r;
-    double level;
-    string comment;
-    SetInhibData(Gillespie *g, uint r, double level, string comment)
-        : g(g), r(r), level(level), comment(comment) {}
-};
+void Gillespie::checkTriggers()
+{
+    for (uint pass = 0; !pendingTriggers.empty(); pass++) {
+        if (pass == 1000) {
+            TRACE_FATAL("Triggers keep firing each other at t = %g", t);
+        }
+        std::vector<uint> due;
+        due.swap(pendingTriggers);
+        std::sort(due.begin(), due.end());
+
+        for (auto i : due) {
+            Trigger &tr = triggers[i];
+            tr.isPending = false;
+            bool isTrue = conditionHolds(tr.condition, tr.op);
+            if (isTrue && !tr.isTrue) {
+                if (tr.action == Trigger::SET_COUNT) {
+                    setMoleculeCount(tr.target, (uint) tr.value);
+                    logSetCount(t, tr.target);
+                } else if (tr.action == Trigger::SET_INHIB) {
+                    setReactionInhibition(tr.target, tr.value);
+                    logSetInhib(t, tr.target, tr.value);
+                } else {
+                    stopTime = Util::min(stopTime, t + tr.value);
+                }
+            }
+            tr.isTrue = isTrue;
+        }
+    }
+}
 
-/**
- * Set a reaction's inhibition level to a specified value
- * This function is called from the event scheduler.
- */
-static void setInhib(
-    double stime, 
-    double now, 
-    SetInhibData *data)
+void Gillespie::setProperty(const string &prop)
+{
+    const char *src = "-check";
+    size_t colon = prop.find(':');
+    string errMsg;
+    std::vector<string> head =
+        Util::tokenize(prop.substr(0, colon), " ", errMsg);
+    bool at = !head.empty() && Util::strCiEq(head[0], "at");
+    if (colon == string::npos || head.size() != (at ? 2 : 3) ||
+        !(at || Util::strCiEq(head[0], "always") ||
+          Util::strCiEq(head[0], "eventually")))
+    {
+        fail(src, 0, "property must be \"at T: condition\", \"always T1 T2: "
+             "condition\" or \"eventually T1 T2: condition\": {}", prop);
+    }
+
+    property.kind = Util::strCiEq(head[0], "eventually")
+        ? Property::EVENTUALLY : Property::ALWAYS;
+    property.from = Util::strToDouble(head[1], errMsg);
+    property.until = at ? property.from : Util::strToDouble(head[2], errMsg);
+    if (!errMsg.empty() || property.from < 0.0 ||
+        property.until < property.from)
+    {
+        fail(src, 0, "invalid time window: {}", prop);
+    }
+    property.condition = compileCondition(prop.substr(colon + 1),
+                                          property.op, src, 0);
+    checking = true;
+}
+
+bool Gillespie::decideProperty(double t0, double t1)
 {
-    data->g->setReactionInhibition(data->r, data->level);
-    delete data;
+    if (t1 > property.from && t0 <= property.until) {
+        bool holds = conditionHolds(property.condition, property.op);
+        if (holds == (property.kind == Property::EVENTUALLY)) {
+            propertyResult = holds;
+            return true;
+        }
+    }
+    if (t1 > property.until) {
+        propertyResult = property.kind == Property::ALWAYS;
+        return true;
+    }
+    return false;
 }
 
 static uint checkParams(
@@ -697,6 +1750,29 @@ static uint checkParams(
     return n;
 }
 
+/**
+ * Convert a directive parameter to a number, or fail
+ */
+static double paramToDouble(const string &s, string fname, uint lineNum)
+{
+    string errMsg;
+    double d = Util::strToDouble(s, errMsg);
+    if (!errMsg.empty()) {
+        fail(fname, lineNum, "{}: {}", errMsg, s);
+    }
+    return d;
+}
+
+static uint paramToUint(const string &s, string fname, uint lineNum)
+{
+    string errMsg;
+    uint u = Util::strToUint(s, errMsg);
+    if (!errMsg.empty()) {
+        fail(fname, lineNum, "{}: {}", errMsg, s);
+    }
+    return u;
+}
+
 /*
  * Read system from .gil file
  * @param fname File name
@@ -704,8 +1780,6 @@ static uint checkParams(
  */
 uint Gillespie::readGilFile(const char *fname)
 {
-    static bool overrideAllowed = false;
-
     const char *suffix = ".gil";
     FILE *fp = fopen(fname, "r");
 
@@ -785,6 +1859,13 @@ uint Gillespie::readGilFile(const char *fname)
             symSubst(tokens);
             checkParams("idleTick", tokens, 1, 1, fname, lineNum);
             idleTick = std::stod(tokens[0]);
+        } else if (Util::strCiEq(directive, "rateTick")) {
+            symSubst(tokens);
+            checkParams("rateTick", tokens, 1, 1, fname, lineNum);
+            rateTick = std::stod(tokens[0]);
+            if (rateTick <= 0.0) {
+                fail(fname, lineNum, "rateTick must be positive: {}", line);
+            }
         } else if (Util::strCiEq(directive, "molecule")) {
             symSubst(tokens, 1);
             uint nParams =
@@ -845,6 +1926,73 @@ uint Gillespie::readGilFile(const char *fname)
             } else {
                 reactions.push_back(r);
             }
+        } else if (Util::strCiEq(directive, "rate")) {
+            // rate: reaction "expression"
+            //
+            checkParams("rate", tokens, 2, 2, fname, lineNum);
+            uint r = reactionIndex(tokens[0]);
+            if (r >= reactions.size()) {
+                fail(fname, lineNum, "unknown reaction: {}", tokens[0]);
+            }
+            if (reactions[r].rateLaw >= 0 && !overrideAllowed) {
+                fail(fname, lineNum, "reaction {} already has a rate law",
+                     tokens[0]);
+            }
+            reactions[r].rateLaw = expressions.size();
+            expressions.push_back(
+                compileExpression(tokens[1], fname, lineNum));
+        } else if (Util::strCiEq(directive, "trigger")) {
+            // trigger: id "condition" setCount molecule count
+            // trigger: id "condition" setInhib reaction level
+            // trigger: id "condition" stop [delay]
+            //
+            symSubst(tokens, 3);
+            checkParams("trigger", tokens, 3, 5, fname, lineNum);
+            Trigger tr;
+            tr.id = tokens[0];
+            for (auto &other : triggers) {
+                if (other.id == tr.id) {
+                    fail(fname, lineNum, "Duplicate trigger id: {}", tr.id);
+                }
+            }
+
+            tr.condition = compileCondition(tokens[1], tr.op, fname, lineNum);
+
+            const string &action = tokens[2];
+            if (Util::strCiEq(action, "setCount")) {
+                checkParams("trigger setCount", tokens, 5, 5, fname, lineNum);
+                tr.action = Trigger::SET_COUNT;
+                tr.target = moleculeIndex(tokens[3]);
+                if (tr.target >= molecules.size()) {
+                    fail(fname, lineNum, "unknown molecule: {}", tokens[3]);
+                }
+                tr.value = paramToUint(tokens[4], fname, lineNum);
+            } else if (Util::strCiEq(action, "setInhib")) {
+                checkParams("trigger setInhib", tokens, 5, 5, fname, lineNum);
+                tr.action = Trigger::SET_INHIB;
+                tr.target = reactionIndex(tokens[3]);
+                if (tr.target >= reactions.size()) {
+                    fail(fname, lineNum, "unknown reaction: {}", tokens[3]);
+                }
+                tr.value = paramToDouble(tokens[4], fname, lineNum);
+                if (tr.value < 0.0 || tr.value > 1.0) {
+                    fail(fname, lineNum,
+                         "Invalid inhibition level ({}), "
+                         "must be between 0.0 and 1.0", tokens[4]);
+                }
+            } else if (Util::strCiEq(action, "stop")) {
+                checkParams("trigger stop", tokens, 3, 4, fname, lineNum);
+                tr.action = Trigger::STOP;
+                tr.target = 0;
+                tr.value = tokens.size() == 4
+                    ? paramToDouble(tokens[3], fname, lineNum) : 0.0;
+            } else {
+                fail(fname, lineNum,
+                     "Unknown trigger action: {} (setCount, setInhib or stop)",
+                     action);
+            }
+            tr.isTrue = tr.isPending = false;
+            triggers.push_back(tr);
         } else if (Util::strCiEq(directive, "setcount")) {
             symSubst(tokens, 1);
             uint nParams =
@@ -866,11 +2014,9 @@ uint Gillespie::readGilFile(const char *fname)
             }
             string comment = nParams == 4 ? tokens[3] : "";
 
-            SetCountData *sc = new SetCountData(this, m, count, comment);
-            Sched::scheduleEvent(
-                time,
-                (Sched::VoidPtrCallback) setCount,
-                sc);
+            EventState e = { time, EventState::SET_COUNT, m, (double) count,
+                             comment };
+            scheduler.schedule(time, e);
         } else if (Util::strCiEq(directive, "setInhib")) {
             symSubst(tokens, 1);
             uint nParams =
@@ -898,11 +2044,201 @@ uint Gillespie::readGilFile(const char *fname)
                      "must be between 0.0 and 1.0", tokens[2]);
             }
             
-            SetInhibData *md = new SetInhibData(this, r, level, comment);
-            Sched::scheduleEvent(
-                time,
-                (Sched::VoidPtrCallback) setInhib,
-                md);
+            EventState e = { time, EventState::SET_INHIB, r, level, comment };
+            scheduler.schedule(time, e);
+        } else if (Util::strCiEq(directive, "drug")) {
+            // drug: id start stop level reaction ...
+            //
+            symSubst(tokens, 1);
+            checkParams("drug", tokens, 5, UINT_MAX, fname, lineNum);
+            Drug d;
+            d.id = tokens[0];
+            for (auto &other : drugs) {
+                if (other.id == d.id) {
+                    fail(fname, lineNum, "Duplicate drug id: {}", d.id);
+                }
+            }
+            double start = paramToDouble(tokens[1], fname, lineNum);
+            double stop  = paramToDouble(tokens[2], fname, lineNum);
+            double level = paramToDouble(tokens[3], fname, lineNum);
+            if (stop <= start) {
+                fail(fname, lineNum, "stop time must be after start time");
+            }
+            if (level < 0.0 || level > 1.0) {
+                fail(fname, lineNum,
+                     "Invalid inhibition level ({}), "
+                     "must be between 0.0 and 1.0", tokens[3]);
+            }
+            for (uint i = 4; i < tokens.size(); i++) {
+                uint r = reactionIndex(tokens[i]);
+                if (r >= reactions.size()) {
+                    fail(fname, lineNum, "unknown reaction: {}", tokens[i]);
+                }
+                d.reactions.push_back(r);
+            }
+            drugs.push_back(d);
+
+            uint id = drugs.size() - 1;
+            EventState on  = { start, EventState::SET_DRUG, id, level, d.id };
+            EventState off = { stop,  EventState::SET_DRUG, id, 0.0,   d.id };
+            scheduler.schedule(start, on);
+            scheduler.schedule(stop, off);
+        } else if (Util::strCiEq(directive, "profile")) {
+            // profile: id exp start level tau
+            // profile: id ramp start stop from to
+            // profile: id table t1 level1 t2 level2 ...
+            //
+            symSubst(tokens, 2);
+            checkParams("profile", tokens, 5, UINT_MAX, fname, lineNum);
+            Profile p;
+            p.id = tokens[0];
+            for (auto &other : profiles) {
+                if (other.id == p.id) {
+                    fail(fname, lineNum, "Duplicate profile id: {}", p.id);
+                }
+            }
+            std::vector<double> params;
+            for (uint i = 2; i < tokens.size(); i++) {
+                params.push_back(paramToDouble(tokens[i], fname, lineNum));
+            }
+            p.kind = Profile::TABLE;
+            p.start = p.level0 = p.tau = p.end = 0.0;
+            if (Util::strCiEq(tokens[1], "exp")) {
+                checkParams("profile exp", tokens, 5, 5, fname, lineNum);
+                p.kind   = Profile::EXP;
+                p.start  = params[0];
+                p.level0 = params[1];
+                p.tau    = params[2];
+                if (p.tau <= 0.0) {
+                    fail(fname, lineNum, "tau must be > 0");
+                }
+                // Below 1e-9 the level no longer matters
+                p.end = p.start + (p.level0 > 1e-9
+                                   ? p.tau * log(p.level0 / 1e-9) : 0.0);
+            } else if (Util::strCiEq(tokens[1], "ramp")) {
+                checkParams("profile ramp", tokens, 6, 6, fname, lineNum);
+                if (params[1] <= params[0]) {
+                    fail(fname, lineNum, "stop time must be after start time");
+                }
+                p.times  = { params[0], params[1] };
+                p.levels = { params[2], params[3] };
+            } else if (Util::strCiEq(tokens[1], "table")) {
+                if (params.size() % 2 != 0) {
+                    fail(fname, lineNum, "table requires time, level pairs");
+                }
+                for (uint i = 0; i < params.size(); i += 2) {
+                    if (i > 0 && params[i] < p.times.back()) {
+                        fail(fname, lineNum, "table times must not decrease");
+                    }
+                    p.times.push_back(params[i]);
+                    p.levels.push_back(params[i + 1]);
+                }
+            } else {
+                fail(fname, lineNum,
+                     "Unknown profile kind: {} (exp, ramp or table)",
+                     tokens[1]);
+            }
+            for (auto level : p.kind == Profile::EXP
+                     ? std::vector<double>{ p.level0 } : p.levels)
+            {
+                if (level < 0.0 || level > 1.0) {
+                    fail(fname, lineNum,
+                         "Invalid inhibition level ({}), "
+                         "must be between 0.0 and 1.0", level);
+                }
+            }
+            profiles.push_back(p);
+        } else if (Util::strCiEq(directive, "modulate")) {
+            // modulate: profile reaction ...
+            //
+            checkParams("modulate", tokens, 2, UINT_MAX, fname, lineNum);
+            int p;
+            for (p = profiles.size() - 1; p >= 0; p--) {
+                if (profiles[p].id == tokens[0]) break;
+            }
+            if (p < 0) {
+                fail(fname, lineNum, "unknown profile: {}", tokens[0]);
+            }
+            for (uint i = 1; i < tokens.size(); i++) {
+                uint r = reactionIndex(tokens[i]);
+                if (r >= reactions.size()) {
+                    fail(fname, lineNum, "unknown reaction: {}", tokens[i]);
+                }
+                if (reactions[r].profile >= 0) {
+                    fail(fname, lineNum, "reaction {} is already modulated",
+                         tokens[i]);
+                }
+                reactions[r].profile = p;
+            }
+        } else if (Util::strCiEq(directive, "repeat") ||
+                   Util::strCiEq(directive, "train"))
+        {
+            // repeat: id start period count value [comment]
+            // train:  id start period count duration on off [comment]
+            //
+            bool train = Util::strCiEq(directive, "train");
+            symSubst(tokens, 1);
+            uint nValues = train ? 7 : 5;
+            uint nParams = checkParams(train ? "train" : "repeat", tokens,
+                                       nValues, nValues + 1, fname, lineNum);
+            string &id = tokens[0];
+            uint m = moleculeIndex(id);
+            if (m >= molecules.size()) {
+                fail(fname, lineNum, "unknown molecule: {}", id);
+            }
+            double start  = paramToDouble(tokens[1], fname, lineNum);
+            double period = paramToDouble(tokens[2], fname, lineNum);
+            uint   count  = paramToUint(tokens[3], fname, lineNum);
+            string comment = nParams > nValues ? tokens[nValues] : "";
+            if (period <= 0.0 || count == 0) {
+                fail(fname, lineNum, "period and count must be > 0");
+            }
+
+            // One self-rescheduling event per value set, see processEvents
+            //
+            EventState e = { start, EventState::SET_COUNT, m, 0.0, comment,
+                             period, count - 1 };
+            if (train) {
+                double duration = paramToDouble(tokens[4], fname, lineNum);
+                if (duration <= 0.0 || (count > 1 && duration >= period)) {
+                    fail(fname, lineNum,
+                         "duration must be > 0 and less than the period");
+                }
+                e.value = paramToUint(tokens[5], fname, lineNum);
+                scheduler.schedule(e.time, e);
+                e.time  = start + duration;
+                e.value = paramToUint(tokens[6], fname, lineNum);
+            } else {
+                e.value = paramToUint(tokens[4], fname, lineNum);
+            }
+            scheduler.schedule(e.time, e);
+        } else if (Util::strCiEq(directive, "observable")) {
+            symSubst(tokens, 1);
+            checkParams("observable", tokens, 2, 3, fname, lineNum);
+            OutputColumn o =
+                parseObservable(tokens[0], tokens[1], fname, lineNum);
+            uint pos = observableIndex(tokens[0]);
+            if (pos < observables.size()) {
+                if (overrideAllowed) {
+                    observables[pos] = o;
+                } else {
+                    fail(fname, lineNum,
+                         "Duplicate observable id: {}", tokens[0]);
+                }
+            } else {
+                observables.push_back(o);
+            }
+        } else if (Util::strCiEq(directive, "output")) {
+            checkParams("output", tokens, 1, UINT_MAX, fname, lineNum);
+            for (auto &id : tokens) {
+                if (observableIndex(id) >= observables.size() &&
+                    moleculeIndex(id) >= molecules.size())
+                {
+                    fail(fname, lineNum, "unknown molecule or observable: {}",
+                         id);
+                }
+                outputIds.push_back(id);
+            }
         } else if (Util::strCiEq(directive, "allowOverride")) {
             symSubst(tokens);
             checkParams("allowOverride", tokens, 1, 1, fname, lineNum);
@@ -934,14 +2270,11 @@ void Gillespie::verify(const char *fname, uint lineNum)
         fail(fname, lineNum, "volume not specified");
     }
 
-    // Find the max cardinality for any reactant in any reaction
+    // Determine the output columns
     //
-    for (auto r : reactions) {
-        for (auto m : r.left) {
-            if (m > maxK) {
-                maxK = m;
-            }
-        }
+    string errMsg;
+    if (!selectOutput(outputIds, errMsg)) {
+        fail(fname, lineNum, "{}", errMsg);
     }
 
     // Determine max reaction ID length
@@ -961,6 +2294,30 @@ void Gillespie::verify(const char *fname, uint lineNum)
             }
         }
     }
+
+    // A rate law also depends on the molecules it reads, and on the
+    // time if it reads t
+    //
+    for (uint r = 0; r < reactions.size(); r++) {
+        if (reactions[r].rateLaw < 0) continue;
+        Expression *law = expressions[reactions[r].rateLaw];
+        for (auto m : law->molecules) {
+            if (reactions[r].left[m] == 0) {
+                molecules[m].downstreamReactions.push_back(r);
+            }
+        }
+        if (law->usesTime) {
+            timedReactions.push_back(r);
+        }
+    }
+
+    // Subscribe each trigger to the molecules its condition reads
+    //
+    for (uint i = 0; i < triggers.size(); i++) {
+        for (auto m : expressions[triggers[i].condition]->molecules) {
+            molecules[m].triggers.push_back(i);
+        }
+    }
 }
 
 
@@ -978,22 +2335,43 @@ bool Gillespie::isPossible(Reaction &r)
 }
 
 /**
- * Make a header line for the output
- * @param molecules Array of molecules
+ * Make a header line for the output, and set fwidths
  */
-string Gillespie::makeHeader(
-    const std::vector<Molecule> &molecules)
+string Gillespie::makeHeader()
 {
-    fwidths.resize(molecules.size());
+    fwidths.resize(outputColumns.size());
+    outputMeans.assign(outputColumns.size(), 0);
+
+    // Interval means have 2 decimals
+    //
+    uint w = averaging ? mwidth + 3 : mwidth;
 
     string s = fmt::format("{:>{}}", "t", twidth);
-    for (uint m = 0; m < molecules.size(); m++) {
-        fwidths[m] = Util::max(mwidth, (uint) molecules[m].id.size() + 1);
-        s += fmt::format( "{:>{}}", molecules[m].id.c_str(), fwidths[m]);
+    for (uint c = 0; c < outputColumns.size(); c++) {
+        const string &id = outputColumns[c].id;
+        fwidths[c] = Util::max(w, (uint) id.size() + 1);
+        s += fmt::format( "{:>{}}", id.c_str(), fwidths[c]);
     }
     return s;
 }
 
+void Gillespie::takeOutputMeans(double time)
+{
+    moleculeMeans.resize(molecules.size());
+    for (uint m = 0; m < molecules.size(); m++) {
+        moleculeMeans[m] = molecules[m].takeMean(windowStart, time);
+    }
+    windowStart = time;
+
+    for (uint c = 0; c < outputColumns.size(); c++) {
+        double v = 0.0;
+        for (auto &term : outputColumns[c].terms) {
+            v += moleculeMeans[term.first] * term.second;
+        }
+        outputMeans[c] = (uint) llround(v * 100.0);
+    }
+}
+
 void Gillespie::printMolecules()
 {
     fmt::print("Molecule Count Description                               Reactions\n");
@@ -1021,3 +2399,694 @@ void Gillespie::printReactions()
                    r.description);
     }
 }
+
+/**
+ * Binary I/O helpers for snapshots and checkpoints
+ */
+template<class T> static void putVal(FILE *fp, const T &val)
+{
+    fwrite(&val, sizeof(val), 1, fp);
+}
+
+static void putStr(FILE *fp, const string &s)
+{
+    uint32_t len = s.size();
+    putVal(fp, len);
+    fwrite(s.data(), 1, len, fp);
+}
+
+template<class T> static bool getVal(FILE *fp, T &val)
+{
+    return fread(&val, sizeof(val), 1, fp) == 1;
+}
+
+static bool getStr(FILE *fp, string &s)
+{
+    uint32_t len;
+    if (!getVal(fp, len) || len > 1000000) {
+        return false;
+    }
+    s.resize(len);
+    return len == 0 || fread(&s[0], 1, len, fp) == len;
+}
+
+static void putDoubles(FILE *fp, const std::vector<double> &v)
+{
+    putVal(fp, (uint32_t) v.size());
+    for (auto d : v) {
+        putVal(fp, d);
+    }
+}
+
+static bool getDoubles(FILE *fp, std::vector<double> &v)
+{
+    uint32_t n;
+    if (!getVal(fp, n) || n > 1000000) {
+        return false;
+    }
+    v.resize(n);
+    for (auto &d : v) {
+        if (!getVal(fp, d)) return false;
+    }
+    return true;
+}
+
+static void putBytes(FILE *fp, const std::vector<char> &v)
+{
+    uint64_t len = v.size();
+    putVal(fp, len);
+    fwrite(v.data(), 1, len, fp);
+}
+
+static bool getBytes(FILE *fp, std::vector<char> &v)
+{
+    uint64_t len;
+    if (!getVal(fp, len) || len > (1 << 30)) {
+        return false;
+    }
+    v.resize(len);
+    return len == 0 || fread(&v[0], 1, len, fp) == len;
+}
+
+void Gillespie::Snapshot::write(FILE *fp) const
+{
+    putVal(fp, t);
+    putVal(fp, plotTime);
+    putVal(fp, plotInterval);
+    putVal(fp, stopTime);
+    putVal(fp, monitoring);
+    putStr(fp, monitorId);
+    putVal(fp, threshold);
+    putVal(fp, monitorDelay);
+    putVal(fp, monitorInitState);
+    putVal(fp, thresholdReached);
+    putVal(fp, outputFormat);
+
+    putVal(fp, (uint32_t) outputIds.size());
+    for (auto &id : outputIds) {
+        putStr(fp, id);
+    }
+    putVal(fp, (uint32_t) counts.size());
+    for (auto c : counts) {
+        putVal(fp, c);
+    }
+    putVal(fp, averaging);
+    putVal(fp, windowStart);
+    putVal(fp, profileUntil);
+    putVal(fp, sparseDeadband);
+    putVal(fp, sparseMaxGap);
+    putVal(fp, ergodicBurnIn);
+    putVal(fp, ergodicBatches);
+    putVal(fp, steadyWindow);
+    putVal(fp, steadyTol);
+    putVal(fp, steadyNumBatches);
+    putVal(fp, steadyRows);
+    putDoubles(fp, steadySums);
+    putDoubles(fp, steadyBatches);
+    for (uint m = 0; m < counts.size(); m++) {
+        putVal(fp, areas[m]);
+        putVal(fp, since[m]);
+    }
+    putVal(fp, (uint32_t) reactions.size());
+    for (auto &r : reactions) {
+        putVal(fp, r.inhibition);
+        putVal(fp, r.h);
+        putVal(fp, r.a);
+        putVal(fp, r.isDirty);
+        putVal(fp, r.modFactor);
+        putVal(fp, r.clockTime);
+        putVal(fp, r.clockNext);
+    }
+    putVal(fp, (uint32_t) triggers.size());
+    for (auto &tr : triggers) {
+        putVal(fp, tr.isTrue);
+        putVal(fp, tr.isPending);
+    }
+    putVal(fp, (uint32_t) events.size());
+    for (auto &e : events) {
+        putVal(fp, e.time);
+        putVal(fp, e.kind);
+        putVal(fp, e.target);
+        putVal(fp, e.value);
+        putStr(fp, e.comment);
+        putVal(fp, e.period);
+        putVal(fp, e.repeats);
+    }
+    putBytes(fp, outputState);
+    rng.save(fp);
+    putVal(fp, reactionClocks);
+    putVal(fp, (uint32_t) clockRngs.size());
+    for (auto &stream : clockRngs) {
+        stream.save(fp);
+    }
+}
+
+bool Gillespie::Snapshot::read(FILE *fp)
+{
+    uint32_t n;
+    bool ok =
+        getVal(fp, t) &&
+        getVal(fp, plotTime) &&
+        getVal(fp, plotInterval) &&
+        getVal(fp, stopTime) &&
+        getVal(fp, monitoring) &&
+        getStr(fp, monitorId) &&
+        getVal(fp, threshold) &&
+        getVal(fp, monitorDelay) &&
+        getVal(fp, monitorInitState) &&
+        getVal(fp, thresholdReached) &&
+        getVal(fp, outputFormat);
+
+    if (!ok || !getVal(fp, n) || n > 1000000) return false;
+    outputIds.resize(n);
+    for (auto &id : outputIds) {
+        if (!getStr(fp, id)) return false;
+    }
+
+    if (!getVal(fp, n)) return false;
+    counts.resize(n);
+    for (auto &c : counts) {
+        if (!getVal(fp, c)) return false;
+    }
+    if (!getVal(fp, averaging) || !getVal(fp, windowStart) ||
+        !getVal(fp, profileUntil) ||
+        !getVal(fp, sparseDeadband) || !getVal(fp, sparseMaxGap) ||
+        !getVal(fp, ergodicBurnIn) || !getVal(fp, ergodicBatches) ||
+        !getVal(fp, steadyWindow) || !getVal(fp, steadyTol) ||
+        !getVal(fp, steadyNumBatches) ||
+        !getVal(fp, steadyRows) ||
+        !getDoubles(fp, steadySums) || !getDoubles(fp, steadyBatches))
+    {
+        return false;
+    }
+    areas.resize(n);
+    since.resize(n);
+    for (uint m = 0; m < n; m++) {
+        if (!getVal(fp, areas[m]) || !getVal(fp, since[m])) return false;
+    }
+
+    if (!getVal(fp, n)) return false;
+    reactions.resize(n);
+    for (auto &r : reactions) {
+        if (!(getVal(fp, r.inhibition) &&
+              getVal(fp, r.h) &&
+              getVal(fp, r.a) &&
+              getVal(fp, r.isDirty) &&
+              getVal(fp, r.modFactor) &&
+              getVal(fp, r.clockTime) &&
+              getVal(fp, r.clockNext)))
+        {
+            return false;
+        }
+    }
+
+    if (!getVal(fp, n)) return false;
+    triggers.resize(n);
+    for (auto &tr : triggers) {
+        if (!getVal(fp, tr.isTrue) || !getVal(fp, tr.isPending)) {
+            return false;
+        }
+    }
+
+    if (!getVal(fp, n)) return false;
+    events.resize(n);
+    for (auto &e : events) {
+        if (!(getVal(fp, e.time) &&
+              getVal(fp, e.kind) &&
+              getVal(fp, e.target) &&
+              getVal(fp, e.value) &&
+              getStr(fp, e.comment) &&
+              getVal(fp, e.period) &&
+              getVal(fp, e.repeats)))
+        {
+            return false;
+        }
+    }
+    if (!getBytes(fp, outputState) || !rng.restore(fp) ||
+        !getVal(fp, reactionClocks) || !getVal(fp, n) ||
+        n != (reactionClocks ? reactions.size() : 0))
+    {
+        return false;
+    }
+    clockRngs.resize(n);
+    for (auto &stream : clockRngs) {
+        if (!stream.restore(fp)) return false;
+    }
+    return true;
+}
+
+/**
+ * Capture the state of the current run
+ */
+void Gillespie::saveState(Snapshot &snap)
+{
+    snap.t                = t;
+    snap.plotTime         = plotTime;
+    snap.plotInterval     = plotInterval;
+    snap.stopTime         = stopTime;
+    snap.outputFormat     = outputFormat;
+    snap.monitoring       = monitoring;
+    snap.monitorId        = monitor.id;
+    snap.threshold        = threshold;
+    snap.monitorDelay     = monitorDelay;
+    snap.monitorInitState = monitorInitState;
+    snap.thresholdReached = thresholdReached;
+
+    snap.outputIds.clear();
+    for (auto &c : outputColumns) {
+        snap.outputIds.push_back(c.id);
+    }
+
+    snap.counts.clear();
+    snap.areas.clear();
+    snap.since.clear();
+    for (auto &m : molecules) {
+        snap.counts.push_back(m.getCount());
+        snap.areas.push_back(m.getArea());
+        snap.since.push_back(m.getSince());
+    }
+    snap.averaging   = averaging;
+    snap.windowStart = windowStart;
+    snap.profileUntil = profileUntil;
+    snap.sparseDeadband = sparseDeadband;
+    snap.sparseMaxGap   = sparseMaxGap;
+    snap.ergodicBurnIn  = ergodicBurnIn;
+    snap.ergodicBatches = ergodicBatches;
+    snap.steadyWindow   = steadyWindow;
+    snap.steadyTol      = steadyTol;
+    snap.steadyNumBatches = steadyNumBatches;
+    snap.steadyRows     = steadyRows;
+    snap.steadySums     = steadySums;
+    snap.steadyBatches  = steadyBatches;
+
+    snap.reactions.clear();
+    for (auto &r : reactions) {
+        ReactionState rs = { r.inhibition, r.h, r.a, r.isDirty,
+                             r.modFactor, r.clockTime, r.clockNext };
+        snap.reactions.push_back(rs);
+    }
+
+    snap.triggers.clear();
+    for (auto &tr : triggers) {
+        TriggerState ts = { tr.isTrue, tr.isPending };
+        snap.triggers.push_back(ts);
+    }
+
+    snap.events = scheduler.getPending();
+
+    snap.rng = rng;
+    snap.reactionClocks = reactionClocks;
+    snap.clockRngs = reactionClocks ? clockRngs : std::vector<Rng>();
+
+    snap.outputState.clear();
+    if (writer != NULL) {
+        writer->sync();
+        writer->saveState(snap.outputState);
+    }
+}
+
+/**
+ * Remove all scheduled events
+ */
+void Gillespie::discardEvents()
+{
+    scheduler.clear();
+}
+
+/**
+ * Whether another instance has the same molecules and reactions
+ */
+bool Gillespie::sameModel(const Gillespie &other, string &errMsg) const
+{
+    if (molecules.size() != other.molecules.size()) {
+        errMsg = "different numbers of molecules";
+        return false;
+    }
+    for (uint m = 0; m < molecules.size(); m++) {
+        if (molecules[m].id != other.molecules[m].id) {
+            errMsg = fmt::format("molecule {} differs: {} vs {}", m,
+                                 molecules[m].id, other.molecules[m].id);
+            return false;
+        }
+    }
+    if (reactions.size() != other.reactions.size()) {
+        errMsg = "different numbers of reactions";
+        return false;
+    }
+    for (uint r = 0; r < reactions.size(); r++) {
+        const Reaction &r1 = reactions[r];
+        const Reaction &r2 = other.reactions[r];
+        if (r1.id != r2.id || r1.formula != r2.formula || r1.c != r2.c) {
+            errMsg = fmt::format("reaction {} differs", r1.id);
+            return false;
+        }
+        string law1 = r1.rateLaw >= 0 ? expressions[r1.rateLaw]->text : "";
+        string law2 =
+            r2.rateLaw >= 0 ? other.expressions[r2.rateLaw]->text : "";
+        if (law1 != law2) {
+            errMsg = fmt::format("rate law of reaction {} differs", r1.id);
+            return false;
+        }
+    }
+    if (profiles.size() != other.profiles.size()) {
+        errMsg = "different numbers of profiles";
+        return false;
+    }
+    for (uint p = 0; p < profiles.size(); p++) {
+        const Profile &p1 = profiles[p];
+        const Profile &p2 = other.profiles[p];
+        if (p1.kind != p2.kind || p1.start != p2.start ||
+            p1.level0 != p2.level0 || p1.tau != p2.tau ||
+            p1.times != p2.times || p1.levels != p2.levels)
+        {
+            errMsg = fmt::format("profile {} differs", p1.id);
+            return false;
+        }
+    }
+    for (uint r = 0; r < reactions.size(); r++) {
+        if (reactions[r].profile != other.reactions[r].profile) {
+            errMsg = fmt::format("modulation of reaction {} differs",
+                                 reactions[r].id);
+            return false;
+        }
+    }
+    if (triggers.size() != other.triggers.size()) {
+        errMsg = "different numbers of triggers";
+        return false;
+    }
+    for (uint i = 0; i < triggers.size(); i++) {
+        const Trigger &t1 = triggers[i];
+        const Trigger &t2 = other.triggers[i];
+        if (expressions[t1.condition]->text !=
+                other.expressions[t2.condition]->text ||
+            t1.op != t2.op || t1.action != t2.action ||
+            t1.target != t2.target || t1.value != t2.value)
+        {
+            errMsg = fmt::format("trigger {} differs", t1.id);
+            return false;
+        }
+    }
+    if (volume != other.volume ||
+        runIdle != other.runIdle ||
+        idleTick != other.idleTick ||
+        rateTick != other.rateTick)
+    {
+        errMsg = "volume, runIdle, idleTick or rateTick differ";
+        return false;
+    }
+    if (outputColumns.size() != other.outputColumns.size()) {
+        errMsg = "different numbers of output columns";
+        return false;
+    }
+    for (uint c = 0; c < outputColumns.size(); c++) {
+        if (outputColumns[c].id != other.outputColumns[c].id ||
+            outputColumns[c].terms != other.outputColumns[c].terms)
+        {
+            errMsg = fmt::format("output column {} differs",
+                                 outputColumns[c].id);
+            return false;
+        }
+    }
+    return true;
+}
+
+/**
+ * Whether another instance has the same reactions and output columns
+ */
+bool Gillespie::sameReactions(const Gillespie &other, string &errMsg) const
+{
+    if (reactions.size() != other.reactions.size()) {
+        errMsg = "different numbers of reactions";
+        return false;
+    }
+    for (uint r = 0; r < reactions.size(); r++) {
+        if (reactions[r].id != other.reactions[r].id) {
+            errMsg = fmt::format("reaction {} differs: {} vs {}", r,
+                                 reactions[r].id, other.reactions[r].id);
+            return false;
+        }
+    }
+    if (outputColumns.size() != other.outputColumns.size()) {
+        errMsg = "different numbers of output columns";
+        return false;
+    }
+    for (uint c = 0; c < outputColumns.size(); c++) {
+        if (outputColumns[c].id != other.outputColumns[c].id) {
+            errMsg = fmt::format("output column {} differs: {} vs {}", c,
+                                 outputColumns[c].id,
+                                 other.outputColumns[c].id);
+            return false;
+        }
+    }
+    return true;
+}
+
+/**
+ * Replace the state of the current run with a captured one
+ */
+void Gillespie::restoreState(const Snapshot &snap)
+{
+    ABORT_IF(snap.counts.size() != molecules.size(),
+             "Snapshot has %lu molecules, expected %lu",
+             snap.counts.size(), molecules.size());
+    ABORT_IF(snap.reactions.size() != reactions.size(),
+             "Snapshot has %lu reactions, expected %lu",
+             snap.reactions.size(), reactions.size());
+    ABORT_IF(snap.triggers.size() != triggers.size(),
+             "Snapshot has %lu triggers, expected %lu",
+             snap.triggers.size(), triggers.size());
+
+    t                = snap.t;
+    plotTime         = snap.plotTime;
+    plotInterval     = snap.plotInterval;
+    stopTime         = snap.stopTime;
+    outputFormat     = (OutputFormat) snap.outputFormat;
+    monitoring       = snap.monitoring;
+    threshold        = snap.threshold;
+    monitorDelay     = snap.monitorDelay;
+    monitorInitState = snap.monitorInitState;
+    thresholdReached = snap.thresholdReached;
+
+    string errMsg;
+    ABORT_IF(!selectOutput(snap.outputIds, errMsg), "%s", errMsg.c_str());
+    monitor = OutputColumn();
+    ABORT_IF(monitoring && !findColumn(snap.monitorId, monitor, errMsg),
+             "%s", errMsg.c_str());
+
+    for (uint m = 0; m < molecules.size(); m++) {
+        molecules[m].setCount(snap.counts[m]);
+        molecules[m].setArea(snap.areas[m], snap.since[m]);
+    }
+    averaging   = snap.averaging;
+    windowStart = snap.windowStart;
+    profileUntil = snap.profileUntil;
+    sparseDeadband = snap.sparseDeadband;
+    sparseMaxGap   = snap.sparseMaxGap;
+    ergodicBurnIn  = snap.ergodicBurnIn;
+    ergodicBatches = snap.ergodicBatches;
+    steadyWindow   = snap.steadyWindow;
+    steadyTol      = snap.steadyTol;
+    steadyNumBatches = snap.steadyNumBatches;
+    steadyRows     = snap.steadyRows;
+    steadySums     = snap.steadySums;
+    steadyBatches  = snap.steadyBatches;
+
+    // Restore the cached propensities exactly as they were, including
+    // stale ones, so that a resumed run is identical to an uninterrupted one.
+    //
+    for (uint r = 0; r < reactions.size(); r++) {
+        const ReactionState &rs = snap.reactions[r];
+        reactions[r].inhibition = rs.inhibition;
+        reactions[r].h          = rs.h;
+        reactions[r].a          = rs.a;
+        reactions[r].isDirty    = rs.isDirty;
+        reactions[r].modFactor  = rs.modFactor;
+        reactions[r].clockTime  = rs.clockTime;
+        reactions[r].clockNext  = rs.clockNext;
+    }
+    activeStale = true;
+
+    // Setting the counts above touched triggers; replace that
+    //
+    pendingTriggers.clear();
+    for (uint i = 0; i < triggers.size(); i++) {
+        triggers[i].isTrue    = snap.triggers[i].isTrue;
+        triggers[i].isPending = snap.triggers[i].isPending;
+        if (triggers[i].isPending) {
+            pendingTriggers.push_back(i);
+        }
+    }
+
+    // Replace the scheduled events
+    //
+    discardEvents();
+
+    for (auto &es : snap.events) {
+        if (es.kind == EventState::SET_COUNT) {
+            ABORT_IF(es.target >= molecules.size(), "Bad molecule index");
+        } else if (es.kind == EventState::SET_INHIB) {
+            ABORT_IF(es.target >= reactions.size(), "Bad reaction index");
+        } else {
+            ABORT_IF(es.target >= drugs.size(), "Bad drug index");
+        }
+        scheduler.schedule(es.time, es);
+    }
+
+    rng = snap.rng;
+    reactionClocks = snap.reactionClocks;
+    clockRngs = snap.clockRngs;
+
+    // Continue the output where the snapshot left off
+    //
+    openWriter();
+    if (writer != NULL) {
+        ABORT_IF(!writer->restoreState(snap.outputState),
+                 "Snapshot has invalid output state");
+    } else {
+        // Text output without a writer: the state is pending text
+        fwrite(snap.outputState.data(), 1, snap.outputState.size(), out);
+    }
+}
+
+/**
+ * Checkpoint file format: magic, .gil file name, stdout offset,
+ * molecule and reaction ids (for validation), then a Snapshot.
+ */
+static const char CKPT_MAGIC[8] = { 'G', 'I', 'L', 'C', 'K', 'P', 'T', '1' };
+
+void Gillespie::writeCheckpoint(const char *fname)
+{
+    // Make sure that everything output so far is on record, and note how
+    // much that is, so that a resumed run can continue from there.
+    //
+    if (writer != NULL) {
+        writer->sync();
+    }
+    fflush(out);
+    int64_t outputOffset = lseek(fileno(out), 0, SEEK_CUR);
+
+    string tmpName = string(fname) + ".tmp";
+    FILE *fp = fopen(tmpName.c_str(), "wb");
+    if (fp == NULL) {
+        perror(tmpName.c_str());
+        return;
+    }
+
+    fwrite(CKPT_MAGIC, sizeof(CKPT_MAGIC), 1, fp);
+    char *absPath = realpath(gilFileName.c_str(), NULL);
+    putStr(fp, absPath != NULL ? absPath : gilFileName);
+    free(absPath);
+    putVal(fp, outputOffset);
+
+    putVal(fp, (uint32_t) molecules.size());
+    for (auto &m : molecules) {
+        putStr(fp, m.id);
+    }
+    putVal(fp, (uint32_t) reactions.size());
+    for (auto &r : reactions) {
+        putStr(fp, r.id);
+    }
+
+    Snapshot snap;
+    saveState(snap);
+    snap.write(fp);
+
+    bool ok = !ferror(fp);
+    ok = (fclose(fp) == 0) && ok;
+    if (!ok || rename(tmpName.c_str(), fname) != 0) {
+        perror(fname);
+        unlink(tmpName.c_str());
+    }
+}
+
+/**
+ * Open a checkpoint file and read the part that precedes the id lists
+ */
+static FILE *openCheckpoint(
+    const char *fname,
+    string &gilFile,
+    int64_t &outputOffset)
+{
+    FILE *fp = fopen(fname, "rb");
+    if (fp == NULL) {
+        perror(fname);
+        exit(errno);
+    }
+    char magic[sizeof(CKPT_MAGIC)];
+    if (fread(magic, sizeof(magic), 1, fp) != 1 ||
+        memcmp(magic, CKPT_MAGIC, sizeof(magic)) != 0 ||
+        !getStr(fp, gilFile) ||
+        !getVal(fp, outputOffset))
+    {
+        fmt::print(stderr, "{}: not a gil checkpoint file\n", fname);
+        exit(1);
+    }
+    return fp;
+}
+
+string Gillespie::checkpointGilFile(const char *ckptFileName)
+{
+    string gilFile;
+    int64_t outputOffset;
+    fclose(openCheckpoint(ckptFileName, gilFile, outputOffset));
+    return gilFile;
+}
+
+void Gillespie::resume(const char *ckptFileName)
+{
+    string gilFile;
+    int64_t outputOffset;
+    FILE *fp = openCheckpoint(ckptFileName, gilFile, outputOffset);
+
+    // The model must be the one that was checkpointed
+    //
+    uint32_t n;
+    string id;
+    bool ok = getVal(fp, n) && n == molecules.size();
+    for (uint i = 0; ok && i < n; i++) {
+        ok = getStr(fp, id) && id == molecules[i].id;
+    }
+    ok = ok && getVal(fp, n) && n == reactions.size();
+    for (uint i = 0; ok && i < n; i++) {
+        ok = getStr(fp, id) && id == reactions[i].id;
+    }
+    if (!ok) {
+        fmt::print(stderr, "{}: checkpoint does not match {}\n",
+                   ckptFileName, gilFile);
+        exit(1);
+    }
+
+    Snapshot snap;
+    if (!snap.read(fp)) {
+        fmt::print(stderr, "{}: truncated checkpoint file\n", ckptFileName);
+        exit(1);
+    }
+    fclose(fp);
+    restoreState(snap);
+
+    // Discard any output produced after the checkpoint was written
+    //
+    int fd = fileno(out);
+    struct stat st;
+    if (outputOffset >= 0 && fstat(fd, &st) == 0 && S_ISREG(st.st_mode)) {
+        if (st.st_size >= outputOffset) {
+            if (ftruncate(fd, outputOffset) != 0) {
+                perror("ftruncate");
+            }
+            lseek(fd, outputOffset, SEEK_SET);
+
+            // Output was positioned explicitly; appending (>>) would
+            // defeat in-place updates such as the binary row count
+            //
+            int flags = fcntl(fd, F_GETFL);
+            if (flags != -1 && (flags & O_APPEND)) {
+                fcntl(fd, F_SETFL, flags & ~O_APPEND);
+            }
+        } else {
+            TRACE_WARN("Output is shorter than at checkpoint time; "
+                       "appending anyway");
+        }
+    }
+
+    simulate();
+}
@@ -34,8 +34,17 @@
 
 #include <limits.h>
 #include <float.h>
+#include <time.h>
+#include <vector>
+#include <string>
+using std::string;
 
 #include "Trace.hh"
+#include "Rng.hh"
+#include "Sched.hh"
+#include "TrajIO.hh"
+
+struct te_expr;
 
 class Gillespie {
 public:
@@ -45,6 +54,26 @@ public:
     Gillespie(
         const char *gilFileName,
         void (*preIterFunc)(double time) = NULL);
+
+    /**
+     * Destructor
+     */
+    ~Gillespie();
+
+    /**
+     * Output formats
+     */
+    enum OutputFormat {
+        FORMAT_TEXT,  // space-padded text columns
+        FORMAT_BIN,   // binary trajectory file (see TrajIO.hh)
+        FORMAT_DELTA, // delta-compressed trajectory file
+        FORMAT_ESTORE,// one run of an ensemble store
+        FORMAT_EVENTS,// log of reactions and scheduled events
+        FORMAT_STATS, // mean, stdev, min and max of each count
+        FORMAT_SPARSE,// rows only where the counts change
+        FORMAT_ERGODIC,// time-weighted statistics after a burn-in
+        FORMAT_NONE   // nothing (with outputs added by addOutput)
+    };
     
     /**
      * Print molecule info
@@ -61,24 +90,58 @@ public:
     /**
      * Run the Gillespie algorithm until (a) stopTime is reached, or (b) no
      * more reactions are possible, or (c) the count of a specified molecule
-     * passes through a specified threshold (from either direction.)
+     * passes through a specified threshold (from either direction), or
+     * (d) a checked property is decided (see setProperty.)
      * 
      * @param plotInterval Time interval between molecule count outputs
      * @param stopTime Simulated time at which to stop unconditionally
-     * @param monitorId Id of molecule to be monitored
+     * @param monitorId Id of molecule or observable to be monitored
      * @param threshold Stop after monitored molecule count reaches this
      *        value
      * @param monitorDelay Continue for this time interval after threshold
      *        reached
-     * @param runIdle Keep running even if no reaction can run
-     * @param idleTick Length of time step while idling
+     * @param pauseTime Pause when, at the top of the simulation loop,
+     *        the simulated time exceeds this value. The run can then be
+     *        continued with continueRun.
      */
     void run(
         double plotInterval,
         double stopTime,
         const char *monitorId = NULL,
         double threshold = -DBL_MAX,
-        double monitorDelay = 0.0);
+        double monitorDelay = 0.0,
+        double pauseTime = DBL_MAX);
+
+    /**
+     * Continue a run that was paused, or whose state was restored
+     * @param pauseTime Pause when the simulated time exceeds this value
+     */
+    void continueRun(double pauseTime = DBL_MAX) { simulate(pauseTime); }
+
+    /**
+     * Resume a run from a checkpoint file. The run parameters (plot
+     * interval, stop time, monitoring) are taken from the checkpoint.
+     * If stdout is a regular file, it is first truncated to the length it
+     * had when the checkpoint was written, so that output continues
+     * exactly where the checkpointed run left off.
+     * @param ckptFileName Checkpoint file
+     */
+    void resume(const char *ckptFileName);
+
+    /**
+     * Enable checkpointing. A checkpoint is written every interval seconds
+     * (wall clock time) and when SIGTERM is received, after which the
+     * process exits.
+     * @param fileName Checkpoint file
+     * @param interval Seconds between checkpoints; 0 means only on SIGTERM
+     */
+    void setCheckpoint(const char *fileName, double interval);
+
+    /**
+     * Get the name of the .gil file that a checkpoint was made from
+     * @param ckptFileName Checkpoint file
+     */
+    static string checkpointGilFile(const char *ckptFileName);
 
     /**
      * Member accessors
@@ -86,6 +149,160 @@ public:
     void setMwidth(uint w) { mwidth = w; }
     void setTwidth(uint w) { twidth = w; }
     void setRwidth(uint w) { rwidth = w; }
+    void setSeed(uint64_t seed) { rng.setSeed(seed); }
+    void setOutput(FILE *fp);
+    void setOutputFormat(OutputFormat f) { outputFormat = f; }
+
+    /**
+     * Instead of the values at each plot time, output the time-weighted
+     * mean of each column over the preceding plot interval, with 2
+     * decimals. Only for FORMAT_TEXT, and with a plot interval > 0.
+     */
+    void setAveraging(bool on) { averaging = on; }
+
+    /**
+     * Set when FORMAT_SPARSE writes a row (see TrajIO::SparseWriter)
+     * @param deadband Write when a column changes by more than this
+     * @param maxGap Write when this much time has passed; 0: no limit
+     */
+    void setSparse(uint deadband, double maxGap)
+    {
+        sparseDeadband = deadband;
+        sparseMaxGap = maxGap;
+    }
+
+    /**
+     * Set what FORMAT_ERGODIC accumulates (see TrajIO::ErgodicWriter)
+     * @param burnIn Time before which the counts are ignored
+     * @param numBatches Number of batches for the confidence intervals
+     */
+    void setErgodic(double burnIn, uint numBatches)
+    {
+        ergodicBurnIn = burnIn;
+        ergodicBatches = numBatches;
+    }
+
+    /**
+     * Stop early once the run is stationary: after the last scheduled
+     * event, when the means of each output column over consecutive
+     * windows show no drift (see noteSteadyRow). The remaining rows, up
+     * to stopTime, are then written with the means. Requires a plot
+     * interval > 0.
+     * @param window Length of each window (time units); 0: off
+     * @param tolerance Drift allowed beyond the noise, relative to the
+     *        mean
+     * @param numBatches Number of windows compared, even and at least 4
+     */
+    void setSteadyState(double window, double tolerance, uint numBatches)
+    {
+        steadyWindow = window;
+        steadyTol = tolerance;
+        steadyNumBatches = numBatches;
+    }
+
+    /**
+     * Also write the rows to a file, in addition to the output stream.
+     * Only for FORMAT_TEXT, FORMAT_BIN, FORMAT_DELTA, FORMAT_STATS,
+     * FORMAT_SPARSE and FORMAT_ERGODIC,
+     * and not with checkpointing or branching.
+     * @param fileName File to write; exits if it cannot be created
+     */
+    void addOutput(OutputFormat format, const char *fileName);
+
+    /**
+     * Write output to an ensemble store instead of the output stream
+     * @param fileName Ensemble store, shared by all runs
+     * @param run This run's number, 0 .. numRuns - 1
+     * @param numRuns Number of runs in the ensemble
+     */
+    void setEnsembleStore(const char *fileName, uint run, uint numRuns)
+    {
+        outputFormat = FORMAT_ESTORE;
+        estoreFile = fileName;
+        estoreRun = run;
+        estoreNumRuns = numRuns;
+    }
+    /**
+     * Check a bounded temporal property in each run, and stop the run as
+     * soon as the property is decided (see getPropertyResult):
+     *   "at T: condition"              the condition holds at time T
+     *   "always T1 T2: condition"      it holds throughout [T1, T2]
+     *   "eventually T1 T2: condition"  it holds at some time in [T1, T2]
+     * The condition is as in trigger: directives. Exits if the property
+     * is invalid.
+     */
+    void setProperty(const string &property);
+
+    /**
+     * End of the time window of the property; runs need go no further
+     */
+    double getPropertyEnd() const { return property.until; }
+
+    /**
+     * Outcome of the property in the last run: 1 if it holds, 0 if not,
+     * -1 if the run stopped before it was decided
+     */
+    int getPropertyResult() const { return propertyResult; }
+
+    /**
+     * First passage mode: note the times at which a molecule or
+     * observable first reaches each of a set of thresholds (passing
+     * through them in either direction, as with the monitor), and stop
+     * the run as soon as it has reached all of them.
+     * @param id Molecule or observable id
+     * @param thresholds The thresholds
+     * @param errMsg Set if id is unknown
+     * @return false if id is unknown
+     */
+    bool setPassage(
+        const string &id,
+        const std::vector<double> &thresholds,
+        string &errMsg);
+
+    /**
+     * Times at which the last run first reached the thresholds given to
+     * setPassage; DBL_MAX for those it did not reach
+     */
+    const std::vector<double> &getPassageTimes() const
+    {
+        return passageTimes;
+    }
+
+    /**
+     * Stop the run, at the top of the simulation loop, as soon as a
+     * molecule or observable is at or below low, or at or above high.
+     * Forward flux sampling uses this to run from one interface to the
+     * next. The run can then be continued, e.g. with other bounds.
+     * @param id Molecule or observable id
+     * @param errMsg Set if id is unknown
+     * @return false if id is unknown
+     */
+    bool setBounds(const string &id, double low, double high, string &errMsg);
+    void setBounds(double low, double high)
+    {
+        stopBelow = low;
+        stopAbove = high;
+    }
+
+    /**
+     * Current value of the quantity given to setPassage or setBounds
+     */
+    uint getWatchedValue() { return passageValue(); }
+
+    /**
+     * Drive each reaction by its own unit-rate Poisson process, run in
+     * the reaction's internal time (the integral of its propensity), with
+     * its own random stream seeded from the instance's at the start of
+     * each run (the modified next reaction method.) The runs are as
+     * exact as the usual ones, but two instances of similar models that
+     * start with the same random state then share each reaction's
+     * firings as far as their propensities agree, and so stay correlated
+     * (common random numbers.)
+     */
+    void setReactionClocks(bool on) { reactionClocks = on; }
+
+    double getTime() const { return t; }
+    double getLastEventTime() { return lastEventTime; }
     void setMoleculeCount(uint id, uint count)
     {
         ABORT_IF(id > molecules.size(), "Invalid molecule id");
@@ -94,9 +311,206 @@ public:
     void setReactionInhibition(uint id, double inhibition)
     {
         ABORT_IF(id > reactions.size(), "Invalid reaction id");
-        reactions[id].inhibition = inhibition;
+        Reaction &r = reactions[id];
+        if ((inhibition >= 1.0) != (r.inhibition >= 1.0)) {
+            activeStale = true;
+        }
+        r.inhibition = inhibition;
+        r.isDirty = true;
+    }
+
+    /**
+     * Set the inhibition level of all reactions affected by a drug
+     */
+    void setDrugInhibition(uint id, double inhibition)
+    {
+        ABORT_IF(id >= drugs.size(), "Invalid drug id");
+        for (auto r : drugs[id].reactions) {
+            setReactionInhibition(r, inhibition);
+        }
+    }
+
+    /**
+     * Reactions affected by a drug
+     */
+    const std::vector<uint> &getDrugReactions(uint id) const
+    {
+        return drugs[id].reactions;
+    }
+
+    /**
+     * Record changes made by scheduled events in the event log, if any
+     * @param time Simulated time at which the change was made
+     */
+    void logSetCount(double time, uint id)
+    {
+        if (eventLog == NULL) {
+            return;
+        }
+        for (uint c = 0; c < outputColumns.size(); c++) {
+            for (auto &term : outputColumns[c].terms) {
+                if (term.first == id) {
+                    eventLog->logSetCount(time, c, outputValue(c));
+                    break;
+                }
+            }
+        }
+    }
+    void logSetInhib(double time, uint id, double inhibition)
+    {
+        if (eventLog != NULL) {
+            eventLog->logSetInhib(time, id, inhibition);
+        }
     }
     
+    /**
+     * Pending setCount, setInhib or drug event. A periodic event (from a
+     * repeat: or train: directive) reschedules itself when it is
+     * processed, period later, until repeats is 0.
+     */
+    struct EventState {
+        enum Kind { SET_COUNT, SET_INHIB, SET_DRUG };
+        double time;
+        uint   kind;
+        uint   target;  // molecule, reaction or drug index
+        double value;   // count or inhibition level
+        string comment;
+        double period;  // time between occurrences
+        uint   repeats; // occurrences after this one
+
+        /**
+         * Move on to the next occurrence; repeats must be > 0
+         */
+        void advance()
+        {
+            time += period;
+            repeats--;
+        }
+
+        /**
+         * Move on to the first occurrence after a specified time
+         * @return false if there is none
+         */
+        bool advancePast(double t)
+        {
+            while (time <= t) {
+                if (repeats == 0) {
+                    return false;
+                }
+                advance();
+            }
+            return true;
+        }
+    };
+
+    /**
+     * Dynamic state of a reaction
+     */
+    struct ReactionState {
+        double inhibition;
+        uint   h;
+        double a;
+        bool   isDirty;
+        double modFactor;
+        double clockTime;
+        double clockNext;
+    };
+
+    /**
+     * Dynamic state of a trigger
+     */
+    struct TriggerState {
+        bool isTrue;
+        bool isPending;
+    };
+
+    /**
+     * Complete state of a run, sufficient to continue it exactly
+     */
+    struct Snapshot {
+        double t;
+        double plotTime;
+        double plotInterval;
+        double stopTime;
+        bool   monitoring;
+        string monitorId;
+        double threshold;
+        double monitorDelay;
+        bool   monitorInitState;
+        bool   thresholdReached;
+        uint   outputFormat;
+        std::vector<string> outputIds; // ids of the output columns
+        std::vector<uint> counts;
+        bool   averaging;
+        double windowStart;
+        double profileUntil;
+        uint   sparseDeadband;
+        double sparseMaxGap;
+        double ergodicBurnIn;
+        uint   ergodicBatches;
+        double steadyWindow;
+        double steadyTol;
+        uint   steadyNumBatches;
+        uint   steadyRows;
+        std::vector<double> steadySums;
+        std::vector<double> steadyBatches;
+        std::vector<double> areas;     // see Molecule::takeMean
+        std::vector<double> since;
+        std::vector<ReactionState> reactions;
+        std::vector<TriggerState> triggers;
+        std::vector<EventState> events;
+        std::vector<char> outputState; // see TrajIO::Writer::saveState
+        Rng    rng;
+        bool   reactionClocks;
+        std::vector<Rng> clockRngs;
+
+        void write(FILE *fp) const;
+        bool read(FILE *fp);
+    };
+
+    /**
+     * Capture the state of the current run
+     */
+    void saveState(Snapshot &snap);
+
+    /**
+     * Replace the state of the current run, including all scheduled
+     * events, with a previously captured one
+     */
+    void restoreState(const Snapshot &snap);
+
+    /**
+     * Remove all scheduled events
+     */
+    void discardEvents();
+
+    /**
+     * Whether another instance has the same molecules and reactions
+     * (ignoring initial counts and scheduled events)
+     * @param errMsg Set to a description of the first difference found
+     */
+    bool sameModel(const Gillespie &other, string &errMsg) const;
+
+    /**
+     * Whether another instance has the same reactions, in the same order,
+     * and output columns, so that runs with reaction clocks (see
+     * setReactionClocks) correspond. Rates, events and initial counts
+     * may differ.
+     * @param errMsg Set to a description of the first difference found
+     */
+    bool sameReactions(const Gillespie &other, string &errMsg) const;
+
+    /**
+     * Select the output columns, by molecule or observable id. An
+     * observable takes precedence over a molecule with the same id.
+     * @param ids Column ids. If empty, all molecules are output, each
+     *        observable replacing the molecule with the same id or, if
+     *        there is none, following the molecules.
+     * @param errMsg Set to a description of any error
+     * @return false if an id is unknown
+     */
+    bool selectOutput(const std::vector<string> &ids, string &errMsg);
+
 private:
     class Reaction;
     struct Molecule {
@@ -107,13 +521,19 @@ private:
         //
         std::vector<uint> downstreamReactions;
 
+        // Triggers whose conditions read this molecule's count
+        //
+        std::vector<uint> triggers;
+
         // Constructor
         //
         Molecule(Gillespie &g, string id, uint count, string description)
             : id(id),
               description(description),
               g(g),
-              count(count)
+              count(count),
+              area(0.0),
+              since(0.0)
         {}
 
         // Assignment operator
@@ -129,21 +549,57 @@ private:
             : id(other.id),
               description(other.description),
               g(other.g),
-              count(other.count)
+              count(other.count),
+              area(other.area),
+              since(other.since)
         {}
 
         void setCount(uint value)
         {
+            area += count * (g.t - since);
+            since = g.t;
             count = value;
             for (auto r : downstreamReactions) {
                 g.reactions[r].isDirty = true;
             }
+            for (auto i : triggers) {
+                g.touchTrigger(i);
+            }
         }
 
         uint getCount() { return count; }
+
+        // Time-weighted mean count from windowStart to now, which must
+        // be the time of the previous call (or of resetMean). Starts a
+        // new window at now.
+        //
+        double takeMean(double windowStart, double now)
+        {
+            double a = area + count * (now - since);
+            area = 0.0;
+            since = now;
+            return now > windowStart ? a / (now - windowStart) : count;
+        }
+
+        void resetMean(double now)
+        {
+            area = 0.0;
+            since = now;
+        }
+
+        double getArea() const  { return area; }
+        double getSince() const { return since; }
+
+        void setArea(double a, double s)
+        {
+            area = a;
+            since = s;
+        }
     private:
         Gillespie &g;
         uint count;
+        double area;  // integral of count from the window start to since
+        double since; // time of the last count change
     };
 
     class Reaction {
@@ -171,6 +627,15 @@ private:
         bool isDirty;             // h and a need to be recalculated
         bool recalc;              // h and a were recalculated in last iteration
                                   // - used for debug printout only.
+        int profile;              // index of the modulating profile, or -1
+        int rateLaw;              // index in expressions, or -1: mass
+                                  // action
+        double modFactor;         // with a profile: upper bound of
+                                  // (1 - profile level) until profileUntil,
+                                  // which multiplies a
+        double clockTime;         // with reaction clocks: internal time,
+                                  // the integral of a over the run
+        double clockNext;         // internal time of the next firing
         
         // Constructor
         //
@@ -187,6 +652,11 @@ private:
               inhibition(0.0),
               isDirty(true),
               recalc(true),
+              profile(-1),
+              rateLaw(-1),
+              modFactor(1.0),
+              clockTime(0.0),
+              clockNext(0.0),
               g(g)
         {}
 
@@ -212,6 +682,11 @@ private:
               c(other.c),
               isDirty(other.isDirty),
               recalc(other.recalc),
+              profile(other.profile),
+              rateLaw(other.rateLaw),
+              modFactor(other.modFactor),
+              clockTime(other.clockTime),
+              clockNext(other.clockNext),
               g(other.g)
         {}
         
@@ -250,14 +725,42 @@ private:
     bool isPossible(Reaction &r);
 
     /**
-     * Make a header line for the output
-     * @param molecules Array of molecules
+     * Make a header line for the output, and set fwidths
+     */
+    string makeHeader();
+
+    /**
+     * Create the writer for the output format and any added outputs.
+     * The row formats are written by a TrajIO::AsyncWriter, which passes
+     * the rows on to a Writer for each output on a separate thread.
+     * With debug tracing, which is interleaved with the rows, text output
+     * is printed directly instead (plainText is set).
+     */
+    void openWriter();
+
+    /**
+     * Create a Writer for a row format, or NULL for other formats
+     */
+    TrajIO::Writer *newRowWriter(
+        OutputFormat format,
+        FILE *fp,
+        const std::vector<string> &names);
+
+    /**
+     * Main simulation loop, shared by run, continueRun and resume
      */
-    string makeHeader(const std::vector<Molecule> &molecules);
+    void simulate(double pauseTime = DBL_MAX);
+
+    /**
+     * Write a checkpoint file
+     */
+    void writeCheckpoint(const char *fname);
 
     double volume; // containment volume
     bool runIdle;  // whether to keep running when no reactions are possible
     double idleTick; // time step size while idling;
+    double rateTick; // longest step over which a rate law that reads t
+                     // is held constant
     std::vector<Molecule> molecules;
     std::vector<Reaction> reactions;
     void (*preIterFunc)(double time);
@@ -265,11 +768,362 @@ private:
     uint mwidth; // minimum width of molecule count field in output
     uint rwidth; // width of reaction name field in output
     std::vector<uint> fwidths; // field widths in output
+    string header; // output header line
+    Rng rng;       // random number generator
+    string gilFileName;
+
+    // Run state
+    //
+    double t;                 // simulated time
+    double plotTime;          // when to plot next
+    double plotInterval;      // time between plot points
+    double stopTime;          // when to stop
+    bool   monitoring;        // whether a molecule is being monitored
+    double threshold;         // monitor threshold
+    double monitorDelay;      // how long to continue after threshold
+    bool   monitorInitState;  // initially above threshold?
+    bool   thresholdReached;
+
+    // Checkpointing
+    //
+    const char *ckptFileName; // NULL means no checkpointing
+    double ckptInterval;      // wall clock seconds between checkpoints
+    time_t lastCkptTime;
+
+    double lastEventTime;     // time of last check for due events
+    Sched::Scheduler<EventState> scheduler; // setCount and setInhib events
+
+    /**
+     * A set of reactions that a drug: directive inhibits together
+     */
+    struct Drug {
+        string id;
+        std::vector<uint> reactions;
+    };
+    std::vector<Drug> drugs;
+
+    /**
+     * A time course of inhibition, declared by a profile: directive and
+     * applied to reactions by modulate:. Its level multiplies with that
+     * set by setInhib and drug: events: the reaction constant is
+     * multiplied by (1 - inhibition) * (1 - level).
+     */
+    struct Profile {
+        enum Kind {
+            EXP,    // level0 * exp(-(t - start) / tau) from start to end
+            TABLE   // linear between points, last level after them
+        };
+        string id;
+        uint   kind;
+        double start;
+        double level0;
+        double tau;
+        double end;                 // EXP: when the level becomes
+                                    // negligible, and is 0 from then on
+        std::vector<double> times;  // TABLE points
+        std::vector<double> levels;
+
+        /**
+         * Inhibition level at time t. Before the profile starts, 0.
+         */
+        double level(double t) const;
+
+        /**
+         * Lowest inhibition level in [t0, t1]
+         */
+        double minLevel(double t0, double t1) const;
+
+        /**
+         * End of an interval starting at t over which the level changes
+         * little, or DBL_MAX if it no longer changes after t
+         */
+        double windowEnd(double t) const;
+    };
+    std::vector<Profile> profiles;
+    double profileUntil;      // end of the interval for which the
+                              // reactions' modFactors were calculated
+
+    /**
+     * An arithmetic expression over molecule counts, the time and defines:
+     * a rate law (rate: directive, replacing h * c of mass action) or a
+     * trigger condition. It is compiled once; its variables are bound to
+     * values, which evalExpression fills in before each evaluation.
+     */
+    struct Expression {
+        string   text;        // with molecule ids and defines replaced
+        te_expr *expr;
+        std::vector<uint> molecules;  // whose counts the expression reads
+        std::vector<double> values;   // their counts, then t if usesTime
+        bool     usesTime;
+    };
+    std::vector<Expression *> expressions;
+    std::vector<uint> timedReactions; // rate laws that read t, held
+                                      // constant for at most rateTick
+
+    /**
+     * Comparison of a condition, (expression <op> 0)
+     */
+    enum CompareOp { LT, LE, GT, GE, EQ, NE };
+
+    /**
+     * A trigger: directive. Its action is taken whenever its condition
+     * becomes true. The condition is only evaluated after a count that
+     * it reads changed, see Molecule::setCount.
+     */
+    struct Trigger {
+        enum Action { SET_COUNT, SET_INHIB, STOP };
+        string id;
+        uint   condition;     // index in expressions
+        uint   op;            // CompareOp
+        uint   action;
+        uint   target;        // molecule or reaction index
+        double value;         // count, inhibition level or stop delay
+        bool   isTrue;        // condition at the last evaluation
+        bool   isPending;     // in pendingTriggers
+    };
+    std::vector<Trigger> triggers;
+    std::vector<uint> pendingTriggers; // to be evaluated by checkTriggers
+
+    /**
+     * A bounded temporal property, see setProperty. "at T" is
+     * "always T T".
+     */
+    struct Property {
+        enum Kind { ALWAYS, EVENTUALLY };
+        uint   kind;
+        double from;          // time window
+        double until;
+        uint   condition;     // index in expressions
+        uint   op;            // CompareOp
+    };
+    bool     checking;        // whether a property is set
+    Property property;
+    int      propertyResult;  // see getPropertyResult
+
+    /**
+     * Queue a trigger for evaluation
+     */
+    void touchTrigger(uint i)
+    {
+        if (!triggers[i].isPending) {
+            triggers[i].isPending = true;
+            pendingTriggers.push_back(i);
+        }
+    }
+
+    // Reactions that are not fully inhibited, the only ones considered
+    // by calcReactProbs and reaction selection. Rebuilt when stale.
+    //
+    std::vector<uint> activeReactions;
+    bool activeStale;
+
+    bool reactionClocks;      // see setReactionClocks
+    std::vector<Rng> clockRngs; // each reaction's random stream
+    FILE   *out;              // output stream
+    OutputFormat outputFormat;
+    struct ExtraOutput {
+        OutputFormat format;
+        FILE         *fp;
+    };
+    std::vector<ExtraOutput> extraOutputs; // see addOutput
+    TrajIO::Writer *writer;   // unless plainText without extraOutputs
+    bool plainText;           // text output is printed directly
+    bool averaging;           // output interval means, see setAveraging
+    double windowStart;       // start of the current averaging interval
+    std::vector<double> moleculeMeans;
+    std::vector<uint> outputMeans; // in hundredths
+    uint   sparseDeadband;    // with FORMAT_SPARSE, see setSparse
+    double sparseMaxGap;
+    double ergodicBurnIn;     // with FORMAT_ERGODIC, see setErgodic
+    uint   ergodicBatches;
+    double steadyWindow;      // see setSteadyState; 0: off
+    double steadyTol;
+    uint   steadyNumBatches;
+    uint   steadyRows;        // rows in the current batch
+    std::vector<double> steadySums;    // of each column in the batch
+    std::vector<double> steadyBatches; // means of the last batches, each
+                                       // a row of the output columns
+    TrajIO::EventWriter *eventLog; // writer, with FORMAT_EVENTS
+    string estoreFile;        // with FORMAT_ESTORE
+    uint   estoreRun;
+    uint   estoreNumRuns;
+
+    /**
+     * An output column: a weighted sum of molecule counts (a single
+     * molecule with weight 1, for a plain molecule column)
+     */
+    struct OutputColumn {
+        string id;
+        std::vector<std::pair<uint, uint>> terms; // molecule index, weight
+    };
+    std::vector<OutputColumn> observables;   // from observable: directives
+    std::vector<string> outputIds;           // from output: directives
+    std::vector<OutputColumn> outputColumns; // the columns output
+
+    // First passage mode and bounds, see setPassage and setBounds
+    //
+    OutputColumn monitor;     // monitored molecule or observable
+    OutputColumn passage;     // the quantity watched
+    std::vector<double> passageThresholds;
+    std::vector<bool>   passageAbove; // initially above threshold?
+    std::vector<double> passageTimes;
+    uint   passagesLeft;      // thresholds not reached yet
+    double stopBelow;
+    double stopAbove;
+
+    /**
+     * Current value of the quantity watched
+     */
+    uint passageValue() { return columnValue(passage); }
+
+    /**
+     * Current value of a molecule or observable
+     */
+    uint columnValue(const OutputColumn &col)
+    {
+        uint v = 0;
+        for (auto &term : col.terms) {
+            v += molecules[term.first].getCount() * term.second;
+        }
+        return v;
+    }
+
+    /**
+     * Look up a molecule or observable as selectOutput does, an
+     * observable taking precedence over a molecule with the same id.
+     * Used for the monitor and the quantity watched by setPassage and
+     * setBounds, so that an id means the same as in the output.
+     * @return false if id is unknown
+     */
+    bool findColumn(const string &id, OutputColumn &col, string &errMsg);
+
+    /**
+     * Note the thresholds reached at the current time
+     * @return whether all thresholds have been reached
+     */
+    bool notePassages();
+
+    /**
+     * Parse the formula of an observable, e.g. "P + 2 A.P"
+     */
+    OutputColumn parseObservable(
+        const string &id,
+        const string &formula,
+        const char *fname,
+        uint lineNum);
+
+    /**
+     * Current value of an output column
+     */
+    uint outputValue(uint col)
+    {
+        uint v = 0;
+        for (auto &term : outputColumns[col].terms) {
+            v += molecules[term.first].getCount() * term.second;
+        }
+        return v;
+    }
+
+    /**
+     * Value of an output column in the current row: its current value
+     * or, when averaging, its mean over the plot interval in
+     * hundredths (see takeOutputMeans)
+     */
+    uint rowValue(uint col)
+    {
+        return averaging ? outputMeans[col] : outputValue(col);
+    }
+
+    /**
+     * Rebuild activeReactions
+     */
+    void updateActiveReactions();
+
+    /**
+     * Compile the expression of a rate: or trigger: directive, or fail
+     */
+    Expression *compileExpression(
+        const string &expr,
+        string fname,
+        uint lineNum);
+
+    /**
+     * Current value of an expression
+     */
+    double evalExpression(Expression &e);
+
+    /**
+     * Compile a condition "lhs <op> rhs" as (lhs - rhs) <op> 0, or fail.
+     * The condition may not read the time.
+     * @param op Set to the CompareOp
+     * @return Index of the expression in expressions
+     */
+    uint compileCondition(
+        const string &cond,
+        uint &op,
+        string fname,
+        uint lineNum);
+
+    /**
+     * Whether a condition holds for the current counts
+     */
+    bool conditionHolds(uint condition, uint op);
+
+    /**
+     * Decide the property, if the state that held from time t0 until t1
+     * does
+     * @return whether the property is decided
+     */
+    bool decideProperty(double t0, double t1);
+
+    /**
+     * Evaluate the pending triggers and take the actions of those whose
+     * conditions became true, until none are pending
+     */
+    void checkTriggers();
+
+    /**
+     * Steady state detection, see setSteadyState
+     */
+    bool noteSteadyRow();
+    void writeSteadyRows();
+
+    /**
+     * Start a new profile interval at the current time, and mark the
+     * modulated reactions for recalculation
+     */
+    void updateProfileWindow();
+
+    /**
+     * Apply the scheduled events that are due at time now
+     */
+    void processEvents(double now);
+
+    /**
+     * Set outputMeans to the time-weighted means of the output columns
+     * since the previous plot time, and start a new interval at time
+     */
+    void takeOutputMeans(double time);
+
+    /**
+     * Set the writer's counts to the current row values
+     */
+    void setOutputCounts()
+    {
+        for (uint c = 0; c < outputColumns.size(); c++) {
+            writer->setCount(c, rowValue(c));
+        }
+    }
 
     /**
      * Retrieve molecule index by id
      */
     uint moleculeIndex(string id);
+
+    /**
+     * Retrieve observable index by id
+     */
+    uint observableIndex(string id);
     
     /**
      * Retrieve reaction index by id
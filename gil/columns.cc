@@ -30,12 +30,14 @@
  */
 
 #include <unistd.h>
+#include <float.h>
 #include <vector>
 #include <string>
 using std::string;
 #include <format.h>
 #include "Util.hh"
 #include "Trace.hh"
+#include "TrajIO.hh"
 
 // A few abbreviations
 
@@ -51,6 +53,11 @@ const char *traceLevel = "warn";
 static const char *fname    = NULL;  // default is stdin
 static const char *sepChars = " \t"; // input file separator chars
 static const char *osep = "\t";      // output separator
+static const char *estoreFile = NULL; // ensemble store
+static int    runNumber = -1;         // -1 means all runs
+static double fromTime = -DBL_MAX;
+static double toTime = DBL_MAX;
+static double gridInterval = -1.0;    // resampling grid; < 0 means none
 
 /**
  * Print error message and exit
@@ -68,6 +75,72 @@ void fail(string file, uint line, const char *format, const T & ... args)
     exit(1);
 }
 
+/**
+ * Copy columns from an ensemble store. With a run number, the selected
+ * columns of that run are copied. Otherwise, each selected species
+ * yields one column per completed run, named <species>.<run>.
+ */
+static void ensembleColumns(const std::vector<string> &selectedColumns)
+{
+    TrajIO::EnsembleReader ens;
+    string errMsg;
+    if (!ens.open(estoreFile, errMsg)) {
+        fmt::print(stderr, "{}\n", errMsg);
+        exit(1);
+    }
+    if (runNumber >= (int) ens.getNumRuns()) {
+        fmt::print(stderr, "{}: no run {}\n", estoreFile, runNumber);
+        exit(1);
+    }
+
+    // Columns to copy, as (species, run) pairs; species -1 is the time
+    //
+    std::vector<std::pair<int, uint>> cols;
+    std::vector<string> headers;
+    for (auto c : selectedColumns) {
+        int s = -1;
+        if (!Util::strCiEq(c, "t")) {
+            s = ens.speciesIndex(c);
+            if (s < 0) {
+                fmt::print(stderr, "{}: {}: column not found\n",
+                           estoreFile, c);
+                exit(1);
+            }
+        }
+        if (s < 0 || runNumber >= 0) {
+            cols.push_back(std::make_pair(s, runNumber < 0 ? 0 : runNumber));
+            headers.push_back(c);
+        } else {
+            for (uint r = 0; r < ens.getNumRuns(); r++) {
+                if (ens.isDone(r)) {
+                    cols.push_back(std::make_pair(s, r));
+                    headers.push_back(fmt::format("{}.{}", c, r));
+                }
+            }
+        }
+    }
+
+    uint first = ens.timeIndex(fromTime);
+    uint last = ens.timeIndex(toTime);
+    if (last < ens.getNumTimes() && ens.getTime(last) <= toTime) {
+        last++;
+    }
+
+    for (uint i = 0; i < headers.size(); i++) {
+        fmt::print("{}{}", headers[i], i < headers.size() - 1 ? osep : "\n");
+    }
+    for (uint t = first; t < last; t++) {
+        for (uint i = 0; i < cols.size(); i++) {
+            if (cols[i].first < 0) {
+                fmt::print("{:.4f}", ens.getTime(t));
+            } else {
+                fmt::print("{}", ens.getSeries(cols[i].first, cols[i].second)[t]);
+            }
+            fmt::print("{}", i < cols.size() - 1 ? osep : "\n");
+        }
+    }
+}
+
 int main(int argc, char *argv[])
 {
     char *pname = argv[0];
@@ -78,6 +151,11 @@ int main(int argc, char *argv[])
         { "file",     STR,  &fname,                 "file_name" },
         { "sep",      STR,  &sepChars,              "input_separator_chars" },
         { "osep",     STR,  &sepChars,              "output_separator_string" },
+        { "estore",   STR,  &estoreFile,            "ensemble_file" },
+        { "run",      INT,  &runNumber,             "run_number", "(with -estore; default: all)" },
+        { "from",     DBLE, &fromTime,              "start_time", "(with -estore)" },
+        { "to",       DBLE, &toTime,                "end_time",   "(with -estore)" },
+        { "grid",     DBLE, &gridInterval,          "interval",   "(event logs, sparse files; 0: all rows)" },
         { "t",        STR,  &traceLevel,            "trace_level" },
         { "help",     NONE, &help,                  }};
 
@@ -98,6 +176,11 @@ int main(int argc, char *argv[])
         selectedColumns.push_back(argv[optind++]);
     }
 
+    if (estoreFile != NULL) {
+        ensembleColumns(selectedColumns);
+        return 0;
+    }
+
     // Open the input file
     //
     FILE *fp = stdin;
@@ -111,20 +194,44 @@ int main(int argc, char *argv[])
         }
     } 
     
-    // Parse the header line
+    // Parse the header line, or the header of a binary trajectory file
     //
     const uint LINELEN = 2048;
     char line[LINELEN];
     uint lineNum = 1;
-    if (fgets(line, LINELEN, fp) == NULL) {
-        fmt::print(stderr, "{}: failed to read header line\n", fname);
-        exit(errno);
-    }
-    Util::chop(line);
     string errMsg;
-    std::vector<string> headers = Util::tokenize(line, sepChars, errMsg);
-    if (!errMsg.empty()) {
-        fail(fname, lineNum, "{}", errMsg);
+    std::vector<string> headers;
+
+    TrajIO::Reader *reader = NULL;
+    if (TrajIO::isTrajFile(fp)) {
+        reader = TrajIO::openReader(fname, fp, errMsg);
+        if (reader == NULL) {
+            fmt::print(stderr, "{}\n", errMsg);
+            exit(1);
+        }
+        if (gridInterval >= 0.0 && !reader->setGrid(gridInterval)) {
+            fmt::print(stderr,
+                       "{}: -grid applies only to event logs and sparse files\n",
+                       fname);
+            exit(1);
+        }
+        headers = reader->getNames();
+    } else {
+        if (gridInterval >= 0.0) {
+            fmt::print(stderr,
+                       "{}: -grid applies only to event logs and sparse files\n",
+                       fname);
+            exit(1);
+        }
+        if (fgets(line, LINELEN, fp) == NULL) {
+            fmt::print(stderr, "{}: failed to read header line\n", fname);
+            exit(errno);
+        }
+        Util::chop(line);
+        headers = Util::tokenize(line, sepChars, errMsg);
+        if (!errMsg.empty()) {
+            fail(fname, lineNum, "{}", errMsg);
+        }
     }
 
     // Determine which columns to copy
@@ -152,6 +259,29 @@ int main(int argc, char *argv[])
         }
     }
     fmt::print("\n");
+
+    // Copy the selected columns of a binary file. Column 0 is the time.
+    //
+    if (reader != NULL) {
+        std::vector<uint32_t> counts(reader->getNumCounts());
+        for (uint64_t r = 0; r < reader->getNumRows(); r++) {
+            double time = reader->getRow(r, counts.data());
+            for (uint i = 0; i < columnNumbers.size(); i++) {
+                uint c = columnNumbers[i];
+                if (c == 0) {
+                    fmt::print("{:.4f}", time);
+                } else {
+                    fmt::print("{}", counts[c - 1]);
+                }
+                if (i < columnNumbers.size() - 1) {
+                    fmt::print("{}", osep);
+                }
+            }
+            fmt::print("\n");
+        }
+        delete reader;
+        return 0;
+    }
                    
     // Read the rest of the file and copy the
     // selected columns in the specified order
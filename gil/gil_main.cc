@@ -31,7 +31,13 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <errno.h>
 #include <getopt.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <algorithm>
+#include <cmath>
 #include "Trace.hh"
 #include "Util.hh"
 #include "Gillespie.hh"
@@ -51,11 +57,919 @@ double stopTime        = 1.0;
 char   *monitorId      = NULL;
 double monitorThresh   = -DBL_MAX;
 double monitorDelay    = 0.0;
+uint   seed            = 0;
+const char *ckptFile   = NULL;
+double ckptInterval    = 0.0;
+const char *resumeFile = NULL;
+double branchTime      = -1.0;
+const char *format     = "text";
+Gillespie::OutputFormat outputFormat = Gillespie::FORMAT_TEXT;
+std::vector<std::pair<Gillespie::OutputFormat, string>> extraOutputs;
+const char *ofilePattern = "%s.out";
+const char *outputList = NULL;
+const char *estoreFile = NULL;
+uint   runNumber       = 0;
+uint   numRuns         = 1;
 uint   numPlotPoints   = 1000;
+bool   average         = false;
+uint   deadband        = 0;
+double maxGap          = 0.0;
+double burnIn          = 0.0;
+uint   numBatches      = 20;
+double steadyWindow    = 0.0;
+double steadyTol       = 0.05;
+uint   steadyBatches   = 8;
+const char *property   = NULL;
+double probThresh      = 0.5;
+double smcAlpha        = 0.05;
+double smcBeta         = 0.05;
+double indiff          = 0.02;
+uint   maxRuns         = 0;
+const char *passageList = NULL;
+uint   numBins         = 20;
+const char *ffsId      = NULL;
+double ffsBasin        = DBL_MAX;
+const char *ffsIfaces  = NULL;
+uint   ffsTrials       = 100;
+uint   numThreads      = 0;
+bool   coupled         = false;
 bool   help            = false;
 bool   verbose         = false;
 const char *traceLevel = "warn";
 
+/**
+ * Print error message and exit
+ */
+template <typename... T>
+void fail(const char *format, const T & ... args)
+{
+    fmt::print(stderr, format, args...);
+    fmt::print(stderr, "\n");
+    exit(1);
+}
+
+/**
+ * Scenario name: file name without directory and .gil suffix
+ */
+static string scenarioName(const string &fname)
+{
+    string name = fname;
+    size_t slash = name.rfind('/');
+    if (slash != string::npos) {
+        name = name.substr(slash + 1);
+    }
+    size_t len = name.size();
+    if (len > 4 && name.substr(len - 4) == ".gil") {
+        name = name.substr(0, len - 4);
+    }
+    return name;
+}
+
+/**
+ * The occurrences of events up to a specified time, in time order, with
+ * periodic events expanded, and drug events replaced by setInhib events
+ * for their reactions. Simultaneous events are ordered by target, as
+ * their order only matters for the same target.
+ * @param g The simulation the events belong to
+ */
+static std::vector<Gillespie::EventState> occurrences(
+    const Gillespie &g,
+    const std::vector<Gillespie::EventState> &events,
+    double time)
+{
+    std::vector<Gillespie::EventState> occ;
+    for (auto e : events) {
+        if (e.time > time) {
+            continue;
+        }
+        do {
+            if (e.kind == Gillespie::EventState::SET_DRUG) {
+                Gillespie::EventState inhib = e;
+                inhib.kind = Gillespie::EventState::SET_INHIB;
+                for (auto r : g.getDrugReactions(e.target)) {
+                    inhib.target = r;
+                    occ.push_back(inhib);
+                }
+            } else {
+                occ.push_back(e);
+            }
+        } while (e.advancePast(e.time) && e.time <= time);
+    }
+    std::stable_sort(
+        occ.begin(), occ.end(),
+        [](const Gillespie::EventState &a, const Gillespie::EventState &b) {
+            return a.time < b.time ||
+                (a.time == b.time &&
+                 (a.kind < b.kind ||
+                  (a.kind == b.kind && a.target < b.target)));
+        });
+    return occ;
+}
+
+/**
+ * Whether two event lists agree on all events up to a specified time
+ */
+static bool samePrefixEvents(
+    const Gillespie &g1,
+    const std::vector<Gillespie::EventState> &events1,
+    const Gillespie &g2,
+    const std::vector<Gillespie::EventState> &events2,
+    double time)
+{
+    std::vector<Gillespie::EventState> ev1 = occurrences(g1, events1, time);
+    std::vector<Gillespie::EventState> ev2 = occurrences(g2, events2, time);
+    uint i = 0, j = 0;
+    for (;;) {
+        bool more1 = i < ev1.size() && ev1[i].time <= time;
+        bool more2 = j < ev2.size() && ev2[j].time <= time;
+        if (!more1 || !more2) {
+            return more1 == more2;
+        }
+        const Gillespie::EventState &e1 = ev1[i++];
+        const Gillespie::EventState &e2 = ev2[j++];
+        if (e1.time != e2.time || e1.kind != e2.kind ||
+            e1.target != e2.target || e1.value != e2.value)
+        {
+            return false;
+        }
+    }
+}
+
+/**
+ * Apply the -output column selection, if any
+ * @param fname .gil file name, for diagnostics
+ */
+static void selectOutput(Gillespie &g, const char *fname)
+{
+    if (outputList != NULL) {
+        string errMsg;
+        std::vector<string> ids = Util::tokenize(outputList, ",", errMsg);
+        if (errMsg.empty()) {
+            g.selectOutput(ids, errMsg);
+        }
+        if (!errMsg.empty()) {
+            fail("{}: -output: {}", fname, errMsg);
+        }
+    }
+}
+
+/**
+ * Parse a -format list of format[=fileName] items, setting outputFormat
+ * (for the item without a file name, if any) and extraOutputs
+ * @return false if the list is invalid
+ */
+static bool parseFormats(const char *list)
+{
+    static const std::vector<std::pair<const char *, Gillespie::OutputFormat>>
+        formats = {
+            { "text",    Gillespie::FORMAT_TEXT    },
+            { "bin",     Gillespie::FORMAT_BIN     },
+            { "delta",   Gillespie::FORMAT_DELTA   },
+            { "events",  Gillespie::FORMAT_EVENTS  },
+            { "stats",   Gillespie::FORMAT_STATS   },
+            { "sparse",  Gillespie::FORMAT_SPARSE  },
+            { "ergodic", Gillespie::FORMAT_ERGODIC }};
+
+    string errMsg;
+    std::vector<string> items = Util::tokenize(list, ",", errMsg);
+    if (!errMsg.empty() || items.empty()) {
+        return false;
+    }
+
+    bool haveStdout = false;
+    outputFormat = Gillespie::FORMAT_NONE;
+    for (auto &item : items) {
+        size_t eq = item.find('=');
+        string name = item.substr(0, eq);
+        auto f = formats.begin();
+        while (f != formats.end() && !Util::strCiEq(name, f->first)) {
+            f++;
+        }
+        if (f == formats.end()) {
+            return false;
+        }
+        if (eq == string::npos) {
+            if (haveStdout) {
+                return false;
+            }
+            haveStdout = true;
+            outputFormat = f->second;
+        } else if (eq + 1 < item.size()) {
+            extraOutputs.push_back(
+                std::make_pair(f->second, item.substr(eq + 1)));
+        } else {
+            return false;
+        }
+    }
+
+    // The event log is not made of rows; it can only be written alone,
+    // to stdout
+    for (auto &o : extraOutputs) {
+        if (o.first == Gillespie::FORMAT_EVENTS) {
+            return false;
+        }
+    }
+    if (outputFormat == Gillespie::FORMAT_EVENTS && !extraOutputs.empty()) {
+        return false;
+    }
+    return true;
+}
+
+/**
+ * Branching mode: simulate the part that several scenarios have in
+ * common (up to branchTime) once, then continue each scenario from the
+ * state reached, each with its own random substream. The first scenario
+ * continues the random stream of the prefix, so its output is identical
+ * to that of a plain run with the same seed.
+ */
+static void runBranches(
+    const std::vector<string> &files,
+    double plotInterval)
+{
+    // Simulate the prefix using the first scenario, capturing the output
+    //
+    Gillespie g0(files[0].c_str());
+    if (seed != 0) {
+        g0.setSeed(seed);
+    }
+    g0.setOutputFormat(outputFormat);
+    g0.setAveraging(average);
+    g0.setSparse(deadband, maxGap);
+    g0.setErgodic(burnIn, numBatches);
+    g0.setSteadyState(steadyWindow, steadyTol, steadyBatches);
+    selectOutput(g0, files[0].c_str());
+    Gillespie::Snapshot initState;
+    g0.saveState(initState);
+
+    // Check all scenarios before any output is written
+    //
+    std::vector<Gillespie *> sims;
+    std::vector<Gillespie::Snapshot> states(files.size());
+    for (uint k = 0; k < files.size(); k++) {
+        const char *fname = files[k].c_str();
+        sims.push_back(new Gillespie(fname));
+        Gillespie &g = *sims.back();
+        selectOutput(g, fname);
+
+        string errMsg;
+        if (!g.sameModel(g0, errMsg)) {
+            fail("{}: not the same model as {}: {}", fname, files[0], errMsg);
+        }
+        Gillespie::Snapshot &s = states[k];
+        g.saveState(s);
+        if (s.counts != initState.counts) {
+            fail("{}: initial counts differ from {}", fname, files[0]);
+        }
+        if (!samePrefixEvents(g, s.events, g0, initState.events,
+                              branchTime))
+        {
+            fail("{}: events up to t = {} differ from {}",
+                 fname, branchTime, files[0]);
+        }
+    }
+
+    char *prefix = NULL;
+    size_t prefixLen = 0;
+    FILE *mfp = open_memstream(&prefix, &prefixLen);
+    g0.setOutput(mfp);
+    g0.run(plotInterval, stopTime, monitorId, monitorThresh, monitorDelay,
+           branchTime);
+    fflush(mfp);
+
+    Gillespie::Snapshot branchState;
+    g0.saveState(branchState);
+    double eventTime = g0.getLastEventTime();
+    g0.discardEvents();
+
+    for (uint k = 0; k < files.size(); k++) {
+        Gillespie &g = *sims[k];
+
+        // Continue from the branch state with this scenario's remaining
+        // events and the k'th random substream
+        //
+        Gillespie::Snapshot snap = branchState;
+        snap.events.clear();
+        for (auto e : states[k].events) {
+            if (e.advancePast(eventTime)) {
+                snap.events.push_back(e);
+            }
+        }
+        for (uint j = 0; j < k; j++) {
+            snap.rng.longJump();
+        }
+
+        string ofile = ofilePattern;
+        string name = scenarioName(files[k]);
+        for (size_t pos; (pos = ofile.find("%s")) != string::npos; ) {
+            ofile.replace(pos, 2, name);
+        }
+        FILE *fp = fopen(ofile.c_str(), "w");
+        if (fp == NULL) {
+            perror(ofile.c_str());
+            exit(errno);
+        }
+        fwrite(prefix, 1, prefixLen, fp);
+        g.setOutput(fp);
+        g.restoreState(snap);
+        g.continueRun();
+        fclose(fp);
+        g.discardEvents();
+    }
+
+    fclose(mfp);
+    free(prefix);
+    for (auto sim : sims) {
+        delete sim;
+    }
+}
+
+/**
+ * Statistical model checking: repeat runs, each stopped as soon as the
+ * property is decided, until Wald's sequential probability ratio test
+ * accepts either p >= probThresh + indiff or p <= probThresh - indiff,
+ * where p is the probability that a run satisfies the property. alpha
+ * and beta are the probabilities of wrongly accepting the second and
+ * the first. Runs that stop before the property is decided (e.g. by a
+ * trigger) do not count.
+ */
+static void runCheck(const char *fname)
+{
+    Gillespie g(fname);
+    if (seed != 0) {
+        g.setSeed(seed);
+    }
+    g.setOutputFormat(Gillespie::FORMAT_NONE);
+    g.setProperty(property);
+    double end = g.getPropertyEnd();
+
+    double p0 = probThresh + indiff;
+    double p1 = probThresh - indiff;
+    double acceptLow  = log((1.0 - smcBeta) / smcAlpha);
+    double acceptHigh = log(smcBeta / (1.0 - smcAlpha));
+    double llr = 0.0; // log of the likelihood ratio of p1 to p0
+
+    // Each run starts from the initial state, with the next random
+    // substream
+    //
+    Gillespie::Snapshot initState;
+    g.saveState(initState);
+    uint runs = 0, holds = 0, undecided = 0;
+    double simTime = 0.0;
+    while (llr > acceptHigh && llr < acceptLow &&
+           (maxRuns == 0 || runs < maxRuns))
+    {
+        g.restoreState(initState);
+        g.run(end > 0.0 ? end : 1.0, end);
+        initState.rng.longJump();
+        runs++;
+        simTime += std::min(g.getTime(), end);
+
+        int result = g.getPropertyResult();
+        if (result < 0) {
+            undecided++;
+        } else if (result > 0) {
+            holds++;
+            llr += log(p1 / p0);
+        } else {
+            llr += log((1.0 - p1) / (1.0 - p0));
+        }
+    }
+
+    uint decided = runs - undecided;
+    fmt::print("property:  {}\n", property);
+    fmt::print("runs:      {} (holds {}, fails {}, undecided {})\n",
+               runs, holds, decided - holds, undecided);
+    if (decided > 0) {
+        fmt::print("estimate:  {:.4f}\n", (double) holds / decided);
+    }
+    if (end > 0.0) {
+        fmt::print("simulated: {:g} ({:.1f}% of {} full runs)\n",
+                   simTime, 100.0 * simTime / (runs * end), runs);
+    }
+    if (llr <= acceptHigh) {
+        fmt::print("result:    p >= {}", probThresh);
+    } else if (llr >= acceptLow) {
+        fmt::print("result:    p < {}", probThresh);
+    } else {
+        fmt::print("result:    undecided after {} runs", runs);
+    }
+    fmt::print(" (alpha {}, beta {}, indifference {})\n",
+               smcAlpha, smcBeta, indiff);
+}
+
+/**
+ * First passage times: run the model numRuns times, each until the
+ * monitored molecule or observable has reached all the thresholds in
+ * passageList, or stopTime (censored), and print the distribution of the
+ * time at which each threshold was first reached.
+ */
+static void runPassage(const char *fname)
+{
+    Gillespie g(fname);
+    if (seed != 0) {
+        g.setSeed(seed);
+    }
+    g.setOutputFormat(Gillespie::FORMAT_NONE);
+
+    string errMsg;
+    std::vector<string> tokens = Util::tokenize(passageList, ",", errMsg);
+    std::vector<double> thresholds;
+    for (auto &tok : tokens) {
+        thresholds.push_back(Util::strToDouble(tok, errMsg));
+    }
+    if (!errMsg.empty() || thresholds.empty()) {
+        fail("Invalid thresholds: {}", passageList);
+    }
+    if (!g.setPassage(monitorId, thresholds, errMsg)) {
+        fail("{}", errMsg);
+    }
+
+    // Each run starts from the initial state, with the next random
+    // substream
+    //
+    Gillespie::Snapshot initState;
+    g.saveState(initState);
+    std::vector<std::vector<double>> times(thresholds.size());
+    for (uint run = 0; run < numRuns; run++) {
+        g.restoreState(initState);
+        g.run(stopTime, stopTime);
+        initState.rng.longJump();
+        for (uint i = 0; i < thresholds.size(); i++) {
+            times[i].push_back(g.getPassageTimes()[i]);
+        }
+    }
+
+    // Summary: mean and standard deviation of the times of the runs
+    // that reached each threshold, and quantiles over all runs, where
+    // those that did not count as reaching it after stopTime
+    //
+    static const double quantiles[] = { 0.1, 0.25, 0.5, 0.75, 0.9 };
+    fmt::print("# first passage of {}: {} runs, censored at t = {}\n",
+               monitorId, numRuns, stopTime);
+    fmt::print("{:>10}{:>10}{:>10}{:>10}", "threshold", "reached",
+               "mean", "stdev");
+    for (auto q : quantiles) {
+        fmt::print("{:>10}", fmt::format("q{}", lround(q * 100)));
+    }
+    fmt::print("\n");
+    for (uint i = 0; i < thresholds.size(); i++) {
+        std::vector<double> &ti = times[i];
+        std::sort(ti.begin(), ti.end());
+        uint reached = 0;
+        double sum = 0.0, sumSq = 0.0;
+        for (auto x : ti) {
+            if (x != DBL_MAX) {
+                reached++;
+                sum += x;
+                sumSq += x * x;
+            }
+        }
+        double mean = reached > 0 ? sum / reached : 0.0;
+        double var = reached > 1
+            ? (sumSq - reached * mean * mean) / (reached - 1) : 0.0;
+        fmt::print("{:10g}{:10}{:10.2f}{:10.2f}", thresholds[i], reached,
+                   mean, sqrt(std::max(var, 0.0)));
+        for (auto q : quantiles) {
+            double x = ti[std::max(1L, lround(ceil(q * numRuns))) - 1];
+            if (x == DBL_MAX) {
+                fmt::print("{:>10}", fmt::format(">{:g}", stopTime));
+            } else {
+                fmt::print("{:10.2f}", x);
+            }
+        }
+        fmt::print("\n");
+    }
+
+    // Histogram: the fraction of the runs that first reached each
+    // threshold in each bin [t, t + stopTime / numBins)
+    //
+    double binWidth = stopTime / numBins;
+    fmt::print("\n{:>10}", "t");
+    for (auto thresh : thresholds) {
+        fmt::print("{:10g}", thresh);
+    }
+    fmt::print("\n");
+    for (uint b = 0; b < numBins; b++) {
+        fmt::print("{:10.2f}", b * binWidth);
+        for (auto &ti : times) {
+            uint n = 0;
+            for (auto x : ti) {
+                if (x != DBL_MAX &&
+                    std::min((uint) (x / binWidth), numBins - 1) == b)
+                {
+                    n++;
+                }
+            }
+            fmt::print("{:10.4f}", (double) n / numRuns);
+        }
+        fmt::print("\n");
+    }
+}
+
+/**
+ * Forward flux sampling: the trials from one interface, shared by the
+ * threads that run them. Trial j starts from a random one of the states
+ * at the interface, on the j'th random substream, so that the results do
+ * not depend on the number of threads.
+ */
+struct FfsTrials {
+    const std::vector<Gillespie::Snapshot> *starts;
+    double low;             // bounds: the next interface and the basin
+    double high;
+    bool   down;            // whether the next interface is low
+    uint   numTrials;
+    uint   next;            // next trial to run
+    Rng    rng;             // substream of the next trial
+    std::vector<std::pair<uint, Gillespie::Snapshot>> reached; // by trial
+    pthread_mutex_t mutex;
+};
+
+struct FfsWorker {
+    FfsTrials *trials;
+    Gillespie *sim;         // this thread's instance of the model
+};
+
+static void *runFfsTrials(void *arg)
+{
+    FfsTrials &f = *((FfsWorker *) arg)->trials;
+    Gillespie &g = *((FfsWorker *) arg)->sim;
+
+    for (;;) {
+        pthread_mutex_lock(&f.mutex);
+        if (f.next == f.numTrials) {
+            pthread_mutex_unlock(&f.mutex);
+            break;
+        }
+        uint j = f.next++;
+        Rng rng = f.rng;
+        f.rng.longJump();
+        pthread_mutex_unlock(&f.mutex);
+
+        // A trial ends at the next interface (success), on returning to
+        // the basin, or after stopTime
+        //
+        Gillespie::Snapshot s =
+            (*f.starts)[(uint) (rng.uniform() * f.starts->size())];
+        s.rng = rng;
+        s.stopTime = s.t + stopTime;
+        g.restoreState(s);
+        g.setBounds(f.low, f.high);
+        g.continueRun();
+
+        uint v = g.getWatchedValue();
+        if (g.getTime() <= s.stopTime && (f.down ? v <= f.low : v >= f.high)) {
+            Gillespie::Snapshot end;
+            g.saveState(end);
+            pthread_mutex_lock(&f.mutex);
+            f.reached.push_back(std::make_pair(j, end));
+            pthread_mutex_unlock(&f.mutex);
+        }
+    }
+    return NULL;
+}
+
+/**
+ * Forward flux sampling of the transition from a basin (ffsId beyond
+ * ffsBasin) through the interfaces ffsIfaces, of which the last defines
+ * the final state. Phase 1 runs for stopTime and counts the crossings of
+ * the first interface on leaving the basin, storing the states at them.
+ * Then, for each interface, ffsTrials trials are run from the states
+ * stored at it, and the states of those that reach the next interface
+ * before returning to the basin are stored at that. The transition rate
+ * is the flux through the first interface times the fractions of
+ * successful trials.
+ */
+static void runFfs(const char *fname)
+{
+    string errMsg;
+    std::vector<string> tokens = Util::tokenize(ffsIfaces, ",", errMsg);
+    std::vector<double> ifaces;
+    for (auto &tok : tokens) {
+        ifaces.push_back(Util::strToDouble(tok, errMsg));
+    }
+    bool down = ifaces.size() > 0 && ffsBasin > ifaces[0];
+    bool ok = errMsg.empty() && ifaces.size() >= 2 && ffsBasin != ifaces[0];
+    for (uint i = 1; ok && i < ifaces.size(); i++) {
+        ok = down ? ifaces[i] < ifaces[i - 1] : ifaces[i] > ifaces[i - 1];
+    }
+    if (!ok) {
+        fail("-ifaces requires at least 2 interfaces, ordered away from "
+             "-basin: {}", ffsIfaces);
+    }
+
+    // An instance of the model per thread
+    //
+    if (numThreads == 0) {
+        numThreads = std::max(1L, sysconf(_SC_NPROCESSORS_ONLN));
+    }
+    std::vector<Gillespie *> sims;
+    for (uint i = 0; i < numThreads; i++) {
+        Gillespie *sim = new Gillespie(fname);
+        sim->setOutputFormat(Gillespie::FORMAT_NONE);
+        if (!sim->setBounds(ffsId, -DBL_MAX, DBL_MAX, errMsg)) {
+            fail("{}", errMsg);
+        }
+        sims.push_back(sim);
+    }
+    Gillespie &g = *sims[0];
+    if (seed != 0) {
+        g.setSeed(seed);
+    }
+
+    // Bounds that stop a run on reaching an interface, or the basin
+    //
+    double last = ifaces.back();
+    auto toBasin = [&]() {
+        g.setBounds(down ? -DBL_MAX : ffsBasin, down ? ffsBasin : DBL_MAX);
+    };
+    auto toFirst = [&]() {
+        g.setBounds(down ? ifaces[0] : -DBL_MAX, down ? DBL_MAX : ifaces[0]);
+    };
+    auto toLastOrBasin = [&]() {
+        g.setBounds(down ? last : ffsBasin, down ? ffsBasin : last);
+    };
+    auto atLast = [&]() {
+        uint v = g.getWatchedValue();
+        return down ? v <= last : v >= last;
+    };
+
+    // Phase 1: after each crossing of the first interface, the run goes
+    // on until it is back in the basin. The time until then, after a
+    // transition to the final state, does not count.
+    //
+    std::vector<Gillespie::Snapshot> states;
+    double basinTime = 0.0;
+    uint transitions = 0;
+    toBasin();
+    g.run(stopTime, stopTime);
+    double since = g.getTime();
+    bool inBasin = since <= stopTime;
+    while (g.getTime() <= stopTime) {
+        toFirst();
+        g.continueRun();
+        if (g.getTime() > stopTime) {
+            break;
+        }
+        states.push_back(Gillespie::Snapshot());
+        g.saveState(states.back());
+
+        toLastOrBasin();
+        g.continueRun();
+        if (g.getTime() <= stopTime && atLast()) {
+            transitions++;
+            basinTime += g.getTime() - since;
+            toBasin();
+            g.continueRun();
+            since = g.getTime();
+            inBasin = since <= stopTime;
+        }
+    }
+    if (inBasin) {
+        basinTime += stopTime - since;
+    }
+    if (basinTime == 0.0) {
+        fail("{} did not reach the basin ({}) before t = {}",
+             ffsId, ffsBasin, stopTime);
+    }
+    uint numCrossings = states.size();
+    double flux = numCrossings / basinTime;
+
+    fmt::print("# forward flux sampling of {}: basin {}, interfaces {}\n",
+               ffsId, ffsBasin, ffsIfaces);
+    fmt::print("# phase 1: {} crossings of {} in {:g} time units in the "
+               "basin, {} transitions\n",
+               numCrossings, ifaces[0], basinTime, transitions);
+    fmt::print("{:>10}{:>10}{:>10}{:>10}\n", "interface", "trials",
+               "reached", "p");
+
+    // Phase 2: trials from each interface to the next, in parallel
+    //
+    FfsTrials f;
+    pthread_mutex_init(&f.mutex, NULL);
+    Gillespie::Snapshot snap;
+    g.saveState(snap);
+    f.rng = snap.rng;
+    f.rng.longJump();
+
+    double rate = flux;
+    double relVar = numCrossings > 0 ? 1.0 / numCrossings : 0.0;
+    uint i;
+    for (i = 1; i < ifaces.size() && !states.empty(); i++) {
+        f.starts = &states;
+        f.low  = down ? ifaces[i] : ffsBasin;
+        f.high = down ? ffsBasin : ifaces[i];
+        f.down = down;
+        f.numTrials = ffsTrials;
+        f.next = 0;
+        f.reached.clear();
+
+        std::vector<FfsWorker> workers(numThreads);
+        std::vector<pthread_t> threads(numThreads);
+        for (uint k = 0; k < numThreads; k++) {
+            workers[k].trials = &f;
+            workers[k].sim = sims[k];
+            int ret = pthread_create(&threads[k], NULL, runFfsTrials,
+                                     &workers[k]);
+            ABORT_IF(ret != 0, "pthread_create returned %d", ret);
+        }
+        for (auto &th : threads) {
+            pthread_join(th, NULL);
+        }
+
+        std::sort(f.reached.begin(), f.reached.end(),
+                  [](const std::pair<uint, Gillespie::Snapshot> &a,
+                     const std::pair<uint, Gillespie::Snapshot> &b)
+                  { return a.first < b.first; });
+        std::vector<Gillespie::Snapshot> next;
+        for (auto &r : f.reached) {
+            next.push_back(r.second);
+        }
+        states.swap(next);
+
+        double p = (double) states.size() / ffsTrials;
+        fmt::print("{:10g}{:10}{:10}{:10.4f}\n",
+                   ifaces[i], ffsTrials, states.size(), p);
+        if (p > 0.0) {
+            rate *= p;
+            relVar += (1.0 - p) / (p * ffsTrials);
+        }
+    }
+    pthread_mutex_destroy(&f.mutex);
+
+    fmt::print("flux: {:.4g} +- {:.2g}\n", flux,
+               numCrossings > 0 ? flux / sqrt(numCrossings) : 0.0);
+    if (numCrossings == 0) {
+        fmt::print("rate: < {:.2g} (95%, no crossings of {})\n",
+                   3.0 / basinTime, ifaces[0]);
+    } else if (states.empty()) {
+        // No trial got through: with the rule of three, p < 3 / trials
+        fmt::print("rate: < {:.2g} (95%, no trial reached {})\n",
+                   rate * 3.0 / ffsTrials, ifaces[i - 1]);
+    } else {
+        fmt::print("rate: {:.4g} +- {:.2g}\n", rate, rate * sqrt(relVar));
+    }
+
+    for (auto sim : sims) {
+        delete sim;
+    }
+}
+
+/**
+ * Compare two models by numRuns pairs of runs with common random
+ * numbers: both runs of a pair start from the same random state and use
+ * reaction clocks (see Gillespie::setReactionClocks), so that they differ
+ * little more than the models do. For each plot time and output column,
+ * print the mean difference (second model minus first), its standard
+ * error, and the standard error that as many independent pairs would
+ * give.
+ */
+static void runCoupled(const char *fnameA, const char *fnameB,
+                       double plotInterval)
+{
+    Gillespie simA(fnameA), simB(fnameB);
+    Gillespie *sims[2] = { &simA, &simB };
+    const char *fnames[2] = { fnameA, fnameB };
+
+    Gillespie::Snapshot initStates[2];
+    for (uint k = 0; k < 2; k++) {
+        if (seed != 0) {
+            sims[k]->setSeed(seed);
+        }
+        sims[k]->setOutputFormat(Gillespie::FORMAT_NONE);
+        sims[k]->setReactionClocks(true);
+        selectOutput(*sims[k], fnames[k]);
+        sims[k]->saveState(initStates[k]);
+    }
+    string errMsg;
+    if (!simA.sameReactions(simB, errMsg)) {
+        fail("{} and {} can not be coupled: {}", fnameA, fnameB, errMsg);
+    }
+
+    // Each pair starts from the initial states, with the next random
+    // substream for both. The rows of each run are written to a
+    // temporary file, and read back.
+    //
+    std::vector<string> names;
+    uint numCols = 0;
+    std::vector<uint> pairs;           // per row
+    std::vector<double> sums[2], sumSqs[2], diffSums, diffSumSqs;
+    std::vector<double> times;
+    for (uint run = 0; run < numRuns; run++) {
+        TrajIO::Reader *readers[2];
+        FILE *fps[2];
+        for (uint k = 0; k < 2; k++) {
+            initStates[k].rng = initStates[0].rng;
+            sims[k]->restoreState(initStates[k]);
+            if ((fps[k] = tmpfile()) == NULL) {
+                fail("Can't create temporary file: {}", strerror(errno));
+            }
+            sims[k]->setOutput(fps[k]);
+            sims[k]->setOutputFormat(Gillespie::FORMAT_BIN);
+            sims[k]->run(plotInterval, stopTime);
+            fflush(fps[k]);
+            readers[k] = TrajIO::openReader(fnames[k], fps[k], errMsg);
+            if (readers[k] == NULL) {
+                fail("{}", errMsg);
+            }
+        }
+        initStates[0].rng.longJump();
+
+        if (run == 0) {
+            names = readers[0]->getNames();
+            numCols = readers[0]->getNumCounts();
+        }
+
+        // A run stopped by a trigger has fewer rows
+        //
+        uint64_t numRows = std::min(readers[0]->getNumRows(),
+                                    readers[1]->getNumRows());
+        if (numRows > pairs.size()) {
+            pairs.resize(numRows, 0);
+            times.resize(numRows);
+            for (uint k = 0; k < 2; k++) {
+                sums[k].resize(numRows * numCols, 0.0);
+                sumSqs[k].resize(numRows * numCols, 0.0);
+            }
+            diffSums.resize(numRows * numCols, 0.0);
+            diffSumSqs.resize(numRows * numCols, 0.0);
+        }
+        std::vector<uint32_t> counts[2] = {
+            std::vector<uint32_t>(numCols), std::vector<uint32_t>(numCols) };
+        for (uint64_t row = 0; row < numRows; row++) {
+            times[row] = readers[0]->getRow(row, &counts[0][0]);
+            readers[1]->getRow(row, &counts[1][0]);
+            pairs[row]++;
+            for (uint c = 0; c < numCols; c++) {
+                uint i = row * numCols + c;
+                for (uint k = 0; k < 2; k++) {
+                    sums[k][i] += counts[k][c];
+                    sumSqs[k][i] += (double) counts[k][c] * counts[k][c];
+                }
+                double d = (double) counts[1][c] - counts[0][c];
+                diffSums[i] += d;
+                diffSumSqs[i] += d * d;
+            }
+        }
+        for (uint k = 0; k < 2; k++) {
+            delete readers[k];
+            fclose(fps[k]);
+        }
+    }
+
+    // Standard error of a mean from the sums over n values
+    //
+    auto stdErr = [](double sum, double sumSq, uint n) {
+        double mean = sum / n;
+        return n > 1
+            ? sqrt(std::max(sumSq - n * mean * mean, 0.0) / (n - 1) / n)
+            : 0.0;
+    };
+
+    fmt::print("# {} - {}: {} coupled pairs\n",
+               scenarioName(fnameB), scenarioName(fnameA), numRuns);
+    fmt::print("{:>10}", names[0]);
+    std::vector<uint> widths;
+    for (uint c = 0; c < numCols; c++) {
+        widths.push_back(std::max<uint>(12, names[c + 1].size() + 6));
+        fmt::print("{:>{}}{:>{}}{:>{}}", "d_" + names[c + 1], widths[c],
+                   "se_" + names[c + 1], widths[c],
+                   "ind_" + names[c + 1], widths[c]);
+    }
+    fmt::print("\n");
+
+    // Summed over the rows, the variances of the mean differences with
+    // coupled and with independent pairs
+    //
+    std::vector<double> coupledVar(numCols, 0.0), indepVar(numCols, 0.0);
+    for (uint row = 0; row < pairs.size(); row++) {
+        uint n = pairs[row];
+        fmt::print("{:10.4f}", times[row]);
+        for (uint c = 0; c < numCols; c++) {
+            uint i = row * numCols + c;
+            double se = stdErr(diffSums[i], diffSumSqs[i], n);
+            double seA = stdErr(sums[0][i], sumSqs[0][i], n);
+            double seB = stdErr(sums[1][i], sumSqs[1][i], n);
+            double ind = sqrt(seA * seA + seB * seB);
+            coupledVar[c] += se * se;
+            indepVar[c] += ind * ind;
+            fmt::print("{:{}.2f}{:{}.3f}{:{}.3f}", diffSums[i] / n, widths[c],
+                       se, widths[c], ind, widths[c]);
+        }
+        fmt::print("\n");
+    }
+
+    fmt::print("# variance reduction:");
+    for (uint c = 0; c < numCols; c++) {
+        if (coupledVar[c] > 0.0) {
+            fmt::print(" {} {:.3g}", names[c + 1],
+                       indepVar[c] / coupledVar[c]);
+        } else {
+            fmt::print(" {} -", names[c + 1]);
+        }
+    }
+    fmt::print("\n");
+}
+
 int main(int argc, char *argv[])
 {
     char *pname = argv[0];
@@ -66,41 +980,326 @@ int main(int argc, char *argv[])
         { "mid",      STR,  &monitorId,     "monitorId"                           },
         { "mthresh",  DBLE, &monitorThresh, "monitorThreshold"                    },
         { "mdelay",   DBLE, &monitorDelay,  "monitorDelay"                        },
+        { "seed",     UINT, &seed,          "seed",          "(default: clock)"   },
+        { "steady",   DBLE, &steadyWindow,  "window",        "(stop when stationary)"},
+        { "stol",     DBLE, &steadyTol,     "tolerance",     "(with -steady)"     },
+        { "sbatches", UINT, &steadyBatches, "numWindows",    "(with -steady)"     },
+        // Statistical model checking
+        { "check",    STR,  &property,      "property"                            },
+        { "prob",     DBLE, &probThresh,    "probability",   "(with -check)"      },
+        { "alpha",    DBLE, &smcAlpha,      "alpha",         "(with -check)"      },
+        { "beta",     DBLE, &smcBeta,       "beta",          "(with -check)"      },
+        { "indiff",   DBLE, &indiff,        "indifference",  "(with -check)"      },
+        { "maxruns",  UINT, &maxRuns,       "maxRuns",       "(with -check)"      },
+        // First passage times
+        { "fpt",      STR,  &passageList,   "threshold,...", "(with -mid)"        },
+        { "bins",     UINT, &numBins,       "numBins",       "(with -fpt)"        },
+        // Forward flux sampling
+        { "ffs",      STR,  &ffsId,         "id"                                  },
+        { "basin",    DBLE, &ffsBasin,      "basin",         "(with -ffs)"        },
+        { "ifaces",   STR,  &ffsIfaces,     "interface,...", "(with -ffs)"        },
+        { "trials",   UINT, &ffsTrials,     "numTrials",     "(with -ffs)"        },
+        { "threads",  UINT, &numThreads,    "numThreads",    "(with -ffs)"        },
+        // Common random numbers
+        { "couple",   NONE, &coupled,       "",              "(two <fileName>s)"  },
+        // Checkpointing
+        { "ckpt",     STR,  &ckptFile,      "checkpointFile"                      },
+        { "ckint",    DBLE, &ckptInterval,  "checkpointInterval", "(seconds)"     },
+        { "resume",   STR,  &resumeFile,    "checkpointFile"                      },
+        // Branching
+        { "branch",   DBLE, &branchTime,    "branchTime"                          },
+        { "ofile",    STR,  &ofilePattern,  "outputFilePattern", "(with -branch)" },
         // Output control
         { "npp",      UINT, &numPlotPoints, "numPlotPoints", "(use 0 for 'all')"  },
+        { "average",  NONE, &average,       "",              "(interval means)"   },
+        { "output",   STR,  &outputList,    "id,...",        "(columns to output)"},
+        { "format",   STR,  &format,        "format[=file],...", "(default: text)"},
+        { "deadband", UINT, &deadband,      "deadband",      "(with sparse)"      },
+        { "maxgap",   DBLE, &maxGap,        "maxGap",        "(with sparse)"      },
+        { "burnin",   DBLE, &burnIn,        "burnIn",        "(with ergodic)"     },
+        { "batches",  UINT, &numBatches,    "numBatches",    "(with ergodic)"     },
+        { "estore",   STR,  &estoreFile,    "ensembleFile"                        },
+        { "run",      UINT, &runNumber,     "runNumber",     "(with -estore)"     },
+        { "nruns",    UINT, &numRuns,       "numRuns",       "(-estore, -fpt, -couple)"},
         { "t",        STR,  &traceLevel,    "traceLevel"                          },
         { "verbose",  NONE, &verbose,       "",              "print formulas"     },
         { "help",     NONE, &help,          "",                                   }};
 
-    if (Util::parseOpts(argc, argv, optSpecs) != 0 ||
-        optind != argc - 1 ||
+    int parseStatus = Util::parseOpts(argc, argv, optSpecs);
+    int numFiles = argc - optind;
+    bool branching = branchTime >= 0.0;
+
+    if (parseStatus != 0 ||
+        (branching ? numFiles < 1 || resumeFile != NULL || ckptFile != NULL
+                   : numFiles != (coupled ? 2 : resumeFile == NULL ? 1 : 0)) ||
         help) 
     {
-        std::vector<string>nonFlags = { "<fileName>" };
+        std::vector<string>nonFlags = { "<fileName> [<fileName> ...]" };
         Util::usage(parseOptsUsage(pname, optSpecs, true, nonFlags).c_str(), NULL);
         fprintf(stderr, "Note:\n"
                 "When <monitorThreshold> is specified, the simulation will run until the\n"
-                "<monitorId> molecule passes through <monitorThreshold> (in\n"
-                "either direction), and then continue for <monitorDelay> ticks\n"
-                "or until <stopTime> is reached, whichever happens first.\n");
+                "<monitorId> molecule or observable passes through\n"
+                "<monitorThreshold> (in either direction), and then continue for\n"
+                "<monitorDelay> ticks or until <stopTime> is reached, whichever\n"
+                "happens first. As in the output, an observable takes precedence\n"
+                "over a molecule with the same id, here and with -fpt and -ffs.\n"
+                "\n"
+                "With -steady, the simulation stops once, after the last scheduled\n"
+                "event, the means of each output column over the last <numWindows>/2\n"
+                "<window>s differ from those over as many before them, and the slope\n"
+                "of the last <numWindows> window means times <numWindows>/2 is, no\n"
+                "more than the noise (the 95%% bound of a t-test, with the spread of\n"
+                "the later window means) plus <tolerance> (default 0.05) times the\n"
+                "later mean. <window> is at least 2 plot intervals, and is rounded\n"
+                "to whole ones. <numWindows> (default 8) is even and at least 4. The\n"
+                "remaining rows have the means over the later <numWindows>/2 windows.\n"
+                "\n"
+                "With -check, runs are repeated, each stopping as soon as\n"
+                "<property> is decided, until Wald's sequential probability ratio\n"
+                "test accepts that it holds with a probability of at least\n"
+                "<probability> + <indifference> (default 0.5 + 0.02), or at most\n"
+                "<probability> - <indifference>. <alpha> and <beta> (default 0.05)\n"
+                "are the probabilities of wrongly accepting the latter and the\n"
+                "former, and <maxRuns> (default 0: no limit) bounds the number of\n"
+                "runs. <property> is \"at T: condition\", \"always T1 T2: condition\"\n"
+                "or \"eventually T1 T2: condition\", the condition as in trigger:\n"
+                "directives. -stop and the output options do not apply.\n"
+                "\n"
+                "With -fpt, the model is run <numRuns> times, each until the\n"
+                "<monitorId> molecule or observable has passed through all of the\n"
+                "thresholds (as with <monitorThreshold>), or <stopTime>. The number\n"
+                "of runs that reached each threshold, the mean, standard deviation\n"
+                "and quantiles of the time at which they first did, and a histogram\n"
+                "of those times in <numBins> (default 20) bins are printed.\n"
+                "\n"
+                "With -ffs, the rate of transitions from the basin (<id> beyond\n"
+                "<basin>) through the interfaces, the last of which defines the\n"
+                "final state, is estimated by forward flux sampling: the flux\n"
+                "through the first interface from a run of <stopTime>, and the\n"
+                "fractions of <numTrials> (default 100) trials from each interface\n"
+                "that reach the next one before the basin, run on <numThreads>\n"
+                "threads (default: one per CPU). A trial gives up after <stopTime>.\n"
+                "\n"
+                "With -couple, two <fileName>s with the same reactions are compared\n"
+                "by <numRuns> pairs of runs with common random numbers: each\n"
+                "reaction fires on its own random clock, the same in both runs of\n"
+                "a pair. For each plot time and column, the mean difference\n"
+                "(second minus first, d_), its standard error (se_), and the one\n"
+                "independent runs would give (ind_) are printed.\n"
+                "\n"
+                "With -ckpt, a checkpoint is written every <checkpointInterval>\n"
+                "seconds and on SIGTERM. -resume <checkpointFile> continues a run\n"
+                "with the parameters it was started with; no <fileName> is given,\n"
+                "and stdout should be appended (>>) to the original output.\n"
+                "\n"
+                "With -branch, several <fileName>s may be given. They must describe\n"
+                "the same model, with the same events up to <branchTime>. The\n"
+                "simulation up to <branchTime> is done once, after which each\n"
+                "scenario continues separately. Output goes to files named by\n"
+                "<outputFilePattern>, in which %%s is replaced by the scenario name.\n"
+                "Checkpointing is not supported with -branch.\n"
+                "\n"
+                "-output selects the molecules and observables to output, in\n"
+                "place of the file's output: directives.\n"
+                "\n"
+                "With -average, each row has the time-weighted means of the\n"
+                "columns over the plot interval ending at its time, rather than\n"
+                "their values at that time. Only for text output, and -npp not 0.\n"
+                "\n"
+                "-format takes a comma-separated list of text, bin, delta, events,\n"
+                "stats (summary statistics) and sparse, each optionally followed by\n"
+                "=<file>; those without one go to stdout. The outputs are written\n"
+                "on a separate thread. events can not be combined with others.\n"
+                "\n"
+                "-format bin writes a binary trajectory file, and -format delta\n"
+                "a compressed one. mat and columns read both directly (see\n"
+                "include/TrajIO.hh for the layouts). -format events logs each\n"
+                "reaction and scheduled event instead of plot rows; mat and\n"
+                "columns resample it, on any grid given with -grid.\n"
+                "\n"
+                "-format sparse writes a binary file with only the rows in which\n"
+                "a column differs from the last written row by more than\n"
+                "<deadband>, or that are <maxGap> after it (0: no limit). mat and\n"
+                "columns expand it onto the plot interval, or any -grid.\n"
+                "\n"
+                "-format ergodic writes the time-weighted mean, standard deviation\n"
+                "and 95%% confidence interval (from <numBatches> batch means, default\n"
+                "20) of each column over one run after <burnIn>, and the fraction\n"
+                "of the time spent at each value. Use -npp 0 for exact weights.\n"
+                "\n"
+                "With -estore, the output goes into run <runNumber> of an ensemble\n"
+                "store shared by <numRuns> runs, which may run concurrently. All\n"
+                "runs must use the same model, -stop and -npp (not 0).\n");
 	exit(EXIT_FAILURE);
     }
 
-    const char *fname = argv[optind];
-
     if (!Trace::setTraceLevel(traceLevel)) {
         Util::usageExit(parseOptsUsage(pname, optSpecs, true).c_str(), NULL);
     }
+
+    if (!parseFormats(format)) {
+        Util::usageExit(parseOptsUsage(pname, optSpecs, true).c_str(), NULL);
+    }
+    if (!extraOutputs.empty() &&
+        (branching || ckptFile != NULL || resumeFile != NULL))
+    {
+        fail("Output to files (-format ...=file) is not supported with "
+             "-branch, -ckpt or -resume");
+    }
+
+    if (average) {
+        // Interval means are fixed-point numbers, which only the text
+        // format can hold
+        bool allText = outputFormat == Gillespie::FORMAT_TEXT ||
+                       outputFormat == Gillespie::FORMAT_NONE;
+        for (auto &o : extraOutputs) {
+            allText = allText && o.first == Gillespie::FORMAT_TEXT;
+        }
+        if (!allText || estoreFile != NULL || numPlotPoints == 0) {
+            fail("-average requires -format text and -npp greater than 0");
+        }
+    }
+
+    if (steadyWindow > 0.0 &&
+        (numPlotPoints == 0 || outputFormat == Gillespie::FORMAT_EVENTS ||
+         outputFormat == Gillespie::FORMAT_ERGODIC))
+    {
+        fail("-steady requires -npp greater than 0, and no -format events "
+             "or ergodic");
+    }
+    if (steadyWindow > 0.0 && steadyWindow < 2.0 * stopTime / numPlotPoints) {
+        fail("-steady window must be at least 2 plot intervals "
+             "(-stop / -npp = {})", stopTime / numPlotPoints);
+    }
+    if (steadyBatches < 4 || steadyBatches % 2 != 0) {
+        fail("-sbatches must be even and at least 4");
+    }
+    if (burnIn < 0.0 || burnIn >= stopTime || numBatches < 2) {
+        fail("-burnin must be less than -stop, and -batches at least 2");
+    }
+
+    if (estoreFile != NULL &&
+        (outputFormat != Gillespie::FORMAT_TEXT || !extraOutputs.empty() ||
+         branching ||
+         numPlotPoints == 0 || runNumber >= numRuns))
+    {
+        Util::usageExit(parseOptsUsage(pname, optSpecs, true).c_str(), NULL);
+    }
+
+    if (coupled) {
+        if (numRuns < 2 || numPlotPoints == 0 || monitorId != NULL ||
+            ffsId != NULL || passageList != NULL || property != NULL ||
+            branching || ckptFile != NULL || resumeFile != NULL ||
+            estoreFile != NULL || steadyWindow > 0.0 || average ||
+            !extraOutputs.empty())
+        {
+            fail("-couple requires -nruns greater than 1 and -npp greater "
+                 "than 0, and is not supported with -mid, -ffs, -fpt, "
+                 "-check, -branch, -ckpt, -resume, -estore, -steady, "
+                 "-average or output files");
+        }
+        runCoupled(argv[optind], argv[optind + 1], stopTime / numPlotPoints);
+        return 0;
+    }
+
+    if (ffsId != NULL) {
+        if (ffsBasin == DBL_MAX || ffsIfaces == NULL || ffsTrials == 0 ||
+            passageList != NULL || property != NULL || branching ||
+            ckptFile != NULL || resumeFile != NULL || estoreFile != NULL ||
+            steadyWindow > 0.0 || !extraOutputs.empty())
+        {
+            fail("-ffs requires -basin, -ifaces and -trials greater than 0, "
+                 "and is not supported with -fpt, -check, -branch, -ckpt, "
+                 "-resume, -estore, -steady or output files");
+        }
+        runFfs(argv[optind]);
+        return 0;
+    }
+
+    if (passageList != NULL) {
+        if (monitorId == NULL || property != NULL || branching ||
+            ckptFile != NULL || resumeFile != NULL || estoreFile != NULL ||
+            steadyWindow > 0.0 || !extraOutputs.empty() || numBins == 0 ||
+            numRuns == 0)
+        {
+            fail("-fpt requires -mid, and -bins and -nruns greater than 0, "
+                 "and is not supported with -check, -branch, -ckpt, -resume, "
+                 "-estore, -steady or output files");
+        }
+        runPassage(argv[optind]);
+        return 0;
+    }
+
+    if (property != NULL) {
+        if (branching || ckptFile != NULL || resumeFile != NULL ||
+            estoreFile != NULL || steadyWindow > 0.0 ||
+            !extraOutputs.empty())
+        {
+            fail("-check is not supported with -branch, -ckpt, -resume, "
+                 "-estore, -steady or output files");
+        }
+        if (!(probThresh - indiff > 0.0 && probThresh + indiff < 1.0 &&
+              indiff > 0.0 && smcAlpha > 0.0 && smcAlpha < 1.0 &&
+              smcBeta > 0.0 && smcBeta < 1.0))
+        {
+            fail("-check requires 0 < probability - indifference, "
+                 "probability + indifference < 1, indifference > 0 and "
+                 "0 < alpha, beta < 1");
+        }
+        runCheck(argv[optind]);
+        return 0;
+    }
+
+    double plotInterval = 0.0;
+    if (numPlotPoints != 0) { // 0 means "all"
+        plotInterval = stopTime / numPlotPoints;
+    }
+
+    if (branching) {
+        runBranches(std::vector<string>(argv + optind, argv + argc),
+                    plotInterval);
+        return 0;
+    }
+
+    string gilFile;
+    if (resumeFile != NULL) {
+        gilFile = Gillespie::checkpointGilFile(resumeFile);
+        if (ckptFile == NULL) {
+            ckptFile = resumeFile;
+        }
+    } else {
+        gilFile = argv[optind];
+    }
+    const char *fname = gilFile.c_str();
+
     Gillespie g(fname);
+    if (seed != 0) {
+        g.setSeed(seed);
+    }
+    g.setOutputFormat(outputFormat);
+    g.setAveraging(average);
+    g.setSparse(deadband, maxGap);
+    g.setErgodic(burnIn, numBatches);
+    g.setSteadyState(steadyWindow, steadyTol, steadyBatches);
+    selectOutput(g, fname);
+    for (auto &o : extraOutputs) {
+        g.addOutput(o.first, o.second.c_str());
+    }
+    if (estoreFile != NULL) {
+        g.setEnsembleStore(estoreFile, runNumber, numRuns);
+    }
     if (verbose) {
         g.printMolecules();
         putchar('\n');
         g.printReactions();
         putchar('\n');
     }
-    double plotInterval = 0.0;
-    if (numPlotPoints != 0) { // 0 means "all"
-        plotInterval = stopTime / numPlotPoints;
+    if (ckptFile != NULL) {
+        g.setCheckpoint(ckptFile, ckptInterval);
+    }
+    if (resumeFile != NULL) {
+        g.resume(resumeFile);
+        return 0;
     }
     g.run(plotInterval, stopTime, monitorId, monitorThresh, monitorDelay);
 }
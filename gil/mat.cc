@@ -32,10 +32,12 @@
 
 #include <stdlib.h>
 #include <unistd.h>
+#include <float.h>
 #include <set>
 
 #include <format.h>
 #include "Util.hh"
+#include "TrajIO.hh"
 
 
 
@@ -59,6 +61,10 @@ static bool hasIndex = false;
 static const char *sepChars = " \t";
 static const char *prefix = "";
 static const char *suffix = "";
+static const char *estoreFile = NULL;
+static double fromTime = -DBL_MAX;
+static double toTime = DBL_MAX;
+static double gridInterval = -1.0; // resampling grid; < 0 means none
 
 /**
  * Adorn each token in line with prefix and suffix
@@ -86,6 +92,75 @@ string adorn(string line)
     return r;
 }
 
+/**
+ * Read a binary trajectory file into a matrix of doubles
+ * @return The column names, as a header line
+ */
+static string readTrajMatrix(
+    const char *fname,
+    FILE *fp,
+    vector<vector<double>> &mat)
+{
+    string errMsg;
+    TrajIO::Reader *reader = TrajIO::openReader(fname, fp, errMsg);
+    if (reader == NULL) {
+        fmt::print(stderr, "{}\n", errMsg);
+        exit(1);
+    }
+    if (gridInterval >= 0.0 && !reader->setGrid(gridInterval)) {
+        fmt::print(stderr,
+                   "{}: -grid applies only to event logs and sparse files\n",
+                   fname);
+        exit(1);
+    }
+
+    string hdr;
+    for (auto &name : reader->getNames()) {
+        if (!hdr.empty()) {
+            hdr += sepChars[0];
+        }
+        hdr += name;
+    }
+
+    uint numCounts = reader->getNumCounts();
+    vector<uint32_t> counts(numCounts);
+    mat.resize(reader->getNumRows());
+    for (uint64_t r = 0; r < reader->getNumRows(); r++) {
+        vector<double> &row = mat[r];
+        row.reserve(numCounts + 1);
+        row.push_back(reader->getRow(r, counts.data()));
+        for (uint c = 0; c < numCounts; c++) {
+            row.push_back(counts[c]);
+        }
+    }
+    delete reader;
+    return hdr;
+}
+
+/**
+ * Read one run from an ensemble store into a matrix of doubles
+ * @param species Species (column) indices
+ * @param first, last Range of time indices
+ */
+static void readEnsembleMatrix(
+    const TrajIO::EnsembleReader &ens,
+    uint run,
+    const vector<uint> &species,
+    uint first,
+    uint last,
+    vector<vector<double>> &mat)
+{
+    mat.assign(last - first, vector<double>(species.size() + 1));
+    for (uint i = first; i < last; i++) {
+        mat[i - first][0] = ens.getTime(i);
+    }
+    for (uint c = 0; c < species.size(); c++) {
+        const uint32_t *series = ens.getSeries(species[c], run);
+        for (uint i = first; i < last; i++) {
+            mat[i - first][c + 1] = series[i];
+        }
+    }
+}
 
 int main(int argc, char *argv[])
 {
@@ -103,12 +178,19 @@ int main(int argc, char *argv[])
         {"sep",     Util::OPTARG_STR,  &sepChars, "separator_chars"},
         {"prefix",  Util::OPTARG_STR,  &prefix,   "output_header_prefix"},
         {"suffix",  Util::OPTARG_STR,  &suffix,   "output_header_suffix"},
+        {"estore",  Util::OPTARG_STR,  &estoreFile, "ensemble_file"},
+        {"from",    Util::OPTARG_DBLE, &fromTime, "start_time", "(with -estore)"},
+        {"to",      Util::OPTARG_DBLE, &toTime,   "end_time",   "(with -estore)"},
+        {"grid",    Util::OPTARG_DBLE, &gridInterval, "interval", "(event logs, sparse files; 0: all rows)"},
         {"help",    Util::OPTARG_NONE, &help,     }};
 
     std::vector<string> nonFlags =
-        { "{add|sub|mul|div|min|max|avg|stdevp|stdevs|sterr} <file> ..." };
-    if (Util::parseOpts(argc, argv, optSpecs) != 0 ||
-        optind > argc - 2 || help)
+        { "{add|sub|mul|div|min|max|avg|stdevp|stdevs|sterr} <file> ...\n"
+          "    or with -estore: "
+          "{add|...|sterr} [<species> ...]" };
+    int parseStatus = Util::parseOpts(argc, argv, optSpecs);
+    if (parseStatus != 0 ||
+        optind > argc - (estoreFile == NULL ? 2 : 1) || help)
     {
         Util::usage(
             parseOptsUsage(pname, optSpecs, true, nonFlags).c_str(), NULL);
@@ -149,73 +231,13 @@ int main(int argc, char *argv[])
     vector<vector<double>> result;
     vector<vector<double>> sqsum;
 
-    while (optind < argc) {
-        const char *fname = argv[optind++];
-        if (firstFile.empty()) {
-            firstFile = fname;
-        }
-        FILE *fp = fopen(fname, "r");
-        if (fp == NULL) {
-            perror(fname);
-            return 1;
-        }
-
-        vector<vector<double>> mat;
-
-        uint lineNum = 0;
-        char line[1024];
-
-        // Read a matrix of doubles from the file
-
-        while ((fgets(line, sizeof(line), fp) != NULL)) {
-            Util::chop(line);
-            if (++lineNum == 1) {
-                if (hasHdr) {
-                    // This is a header line
-                    if (hdr.empty()) {
-                        hdr = line;
-                        fmt::print("{}\n", adorn(hdr));
-                    } else {
-                        ABORT_IF(chkHdr && (hdr != line),
-                                 "%s and %s have different headers",
-                                 firstFile.c_str(), fname);
-                    }
-                    continue;
-                }
-            }
-            string errMsg;
-            std::vector<string> tokens =
-                Util::tokenize(line, sepChars, errMsg);
-            if (!errMsg.empty()) {
-                fail(fname, lineNum, "{}", errMsg);
-            }
-
-            if (tokens.size() == 0) {
-                fail(fname, lineNum, "empty line", errMsg);
-            }
-
-            if (nCols == 0) {
-                nCols = tokens.size();
-            } else if (tokens.size() != nCols) {
-                fail(fname, lineNum, "Expected {} tokens, found {}",
-                     nCols, tokens.size());
-            }
-
-            vector<double> row;
-            for (auto tok : tokens) {
-            
-                size_t sz;
-                try {
-                    row.push_back(std::stod(tok, &sz));
-                } catch (std::invalid_argument) {
-                    fail(fname, lineNum, "Bad double [{}]", tok);
-                }
-            }
-            mat.push_back(row);
-        }
-    
-        fclose(fp);
-
+    // Combine a matrix into the result
+    //
+    auto accumulate = [&](
+        const vector<vector<double>> &mat,
+        const char *fname,
+        uint lineNum)
+    {
         if (nRows == 0) {
             // First file read
             nRows = mat.size();
@@ -265,6 +287,167 @@ int main(int argc, char *argv[])
                     TRACE_FATAL("Bad operation");
             }
         }
+    };
+
+    // With an ensemble store, the remaining args are species names
+    // (default: all), and each completed run is treated like a file
+    // with an index column
+    //
+    if (estoreFile != NULL) {
+        TrajIO::EnsembleReader ens;
+        string errMsg;
+        if (!ens.open(estoreFile, errMsg)) {
+            fmt::print(stderr, "{}\n", errMsg);
+            exit(1);
+        }
+
+        vector<uint> species;
+        hdr = "t";
+        for (; optind < argc; optind++) {
+            int s = ens.speciesIndex(argv[optind]);
+            if (s < 0) {
+                fmt::print(stderr, "{}: no species {}\n",
+                           estoreFile, argv[optind]);
+                exit(1);
+            }
+            species.push_back(s);
+        }
+        if (species.empty()) {
+            for (uint s = 0; s < ens.getNumSpecies(); s++) {
+                species.push_back(s);
+            }
+        }
+        for (auto s : species) {
+            hdr += sepChars[0];
+            hdr += ens.getNames()[s];
+        }
+        if (hasHdr) {
+            fmt::print("{}\n", adorn(hdr));
+        }
+
+        hasIndex = true;
+        firstFile = estoreFile;
+        nCols = species.size() + 1;
+        uint first = ens.timeIndex(fromTime);
+        uint last = ens.timeIndex(toTime);
+        if (last < ens.getNumTimes() && ens.getTime(last) <= toTime) {
+            last++;
+        }
+        if (last <= first) {
+            fmt::print(stderr, "{}: no times in range\n", estoreFile);
+            exit(1);
+        }
+
+        numFiles = 0;
+        for (uint run = 0; run < ens.getNumRuns(); run++) {
+            if (ens.isDone(run)) {
+                vector<vector<double>> mat;
+                readEnsembleMatrix(ens, run, species, first, last, mat);
+                accumulate(mat, estoreFile, 0);
+                numFiles++;
+            }
+        }
+        if (numFiles == 0) {
+            fmt::print(stderr, "{}: no completed runs\n", estoreFile);
+            exit(1);
+        }
+    }
+
+    while (optind < argc) {
+        const char *fname = argv[optind++];
+        if (firstFile.empty()) {
+            firstFile = fname;
+        }
+        FILE *fp = fopen(fname, "r");
+        if (fp == NULL) {
+            perror(fname);
+            return 1;
+        }
+
+        vector<vector<double>> mat;
+
+        uint lineNum = 0;
+        char line[1024];
+
+        // Read a matrix of doubles from the file
+
+        if (TrajIO::isTrajFile(fp)) {
+            string binHdr = readTrajMatrix(fname, fp, mat);
+            if (hasHdr) {
+                if (hdr.empty()) {
+                    hdr = binHdr;
+                    fmt::print("{}\n", adorn(hdr));
+                } else {
+                    ABORT_IF(chkHdr && (adorn(hdr) != adorn(binHdr)),
+                             "%s and %s have different headers",
+                             firstFile.c_str(), fname);
+                }
+            }
+            lineNum = mat.size();
+            uint binCols = mat.empty() ? 0 : mat[0].size();
+            if (nCols == 0) {
+                nCols = binCols;
+            } else if (binCols != nCols) {
+                fail(fname, lineNum, "Expected {} columns, found {}",
+                     nCols, binCols);
+            }
+        } else {
+            if (gridInterval >= 0.0) {
+                fmt::print(stderr, "{}: -grid applies only to event logs and sparse files\n",
+                           fname);
+                exit(1);
+            }
+            while ((fgets(line, sizeof(line), fp) != NULL)) {
+                Util::chop(line);
+                if (++lineNum == 1) {
+                    if (hasHdr) {
+                        // This is a header line
+                        if (hdr.empty()) {
+                            hdr = line;
+                            fmt::print("{}\n", adorn(hdr));
+                        } else {
+                            ABORT_IF(chkHdr && (hdr != line),
+                                     "%s and %s have different headers",
+                                     firstFile.c_str(), fname);
+                        }
+                        continue;
+                    }
+                }
+                string errMsg;
+                std::vector<string> tokens =
+                    Util::tokenize(line, sepChars, errMsg);
+                if (!errMsg.empty()) {
+                    fail(fname, lineNum, "{}", errMsg);
+                }
+
+                if (tokens.size() == 0) {
+                    fail(fname, lineNum, "empty line", errMsg);
+                }
+
+                if (nCols == 0) {
+                    nCols = tokens.size();
+                } else if (tokens.size() != nCols) {
+                    fail(fname, lineNum, "Expected {} tokens, found {}",
+                         nCols, tokens.size());
+                }
+
+                vector<double> row;
+                for (auto tok : tokens) {
+            
+                    size_t sz;
+                    try {
+                        row.push_back(std::stod(tok, &sz));
+                    } catch (std::invalid_argument) {
+                        fail(fname, lineNum, "Bad double [{}]", tok);
+                    }
+                }
+                mat.push_back(row);
+            }
+        }
+    
+        fclose(fp);
+
+        accumulate(mat, fname, lineNum);
     }
     switch (op) {
         case Util::AVG:
@@ -0,0 +1,143 @@
+/**
+ * @file Rng.hh
+ *
+ * Buffered random number generator
+ *
+ * Copyright (c) 2016 - 2018, Peter Helfer
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS
+ * IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO,
+ * THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+ * PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+ * EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef RNG_HH
+#define RNG_HH
+
+#include <stdio.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+/**
+ * Buffered random number generator
+ *
+ * Raw 64-bit numbers come from LANES interleaved xoshiro256++ generators
+ * whose state is stored lane by lane, so that the refill loop can be
+ * vectorized by the compiler. Uniform and exponential variates are
+ * produced a block at a time (exponentials by the Marsaglia-Tsang ziggurat
+ * method) and handed out from small, cache-resident buffers.
+ *
+ * An Rng contains no pointers, so it may be freely copied, and saved to or
+ * restored from a file to capture the exact state of a random stream.
+ */
+class Rng {
+public:
+    enum {
+        LANES = 4,   // number of interleaved generators
+        BLOCK = 256  // buffer size; must be a multiple of LANES
+    };
+
+    /**
+     * Constructor
+     * @param seed Seed value
+     */
+    Rng(uint64_t seed = 0) { setSeed(seed); }
+
+    /**
+     * Seed the generator. Successive lanes are 2^128 draws apart.
+     * Buffered values are discarded.
+     * @param seed Seed value
+     */
+    void setSeed(uint64_t seed);
+
+    /**
+     * Seed the generator from the system clock and the process id
+     * @return The seed that was used
+     */
+    uint64_t seedFromClock();
+
+    /**
+     * Advance every lane by 2^192 draws. Use this to obtain independent,
+     * non-overlapping substreams from copies of a generator. Buffered
+     * values are discarded.
+     */
+    void longJump();
+
+    /**
+     * Uniform variate in the open interval (0, 1)
+     */
+    double uniform()
+    {
+        if (uPos == BLOCK) {
+            refillUniform();
+        }
+        return uBuf[uPos++];
+    }
+
+    /**
+     * Exponential variate with mean 1. Never returns 0.
+     */
+    double exponential()
+    {
+        if (ePos == BLOCK) {
+            refillExponential();
+        }
+        return eBuf[ePos++];
+    }
+
+    /**
+     * Write the complete generator state to a file
+     * @return true if successful
+     */
+    bool save(FILE *fp) const;
+
+    /**
+     * Read the complete generator state from a file
+     * @return true if successful
+     */
+    bool restore(FILE *fp);
+
+private:
+    uint64_t s[4][LANES];    // xoshiro256 state, lane-interleaved
+    uint64_t raw[BLOCK];     // raw output
+    uint     rawPos;
+    double   uBuf[BLOCK];    // uniform variates
+    uint     uPos;
+    double   eBuf[BLOCK];    // exponential variates
+    uint     ePos;
+
+    void refillRaw();
+    void refillUniform();
+    void refillExponential();
+    void jump(const uint64_t poly[4], uint lane);
+
+    uint64_t nextRaw()
+    {
+        if (rawPos == BLOCK) {
+            refillRaw();
+        }
+        return raw[rawPos++];
+    }
+
+    double zigguratExp();
+};
+
+#endif
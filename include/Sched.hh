@@ -30,6 +30,9 @@
 #ifndef SCHED_HH
 #define SCHED_HH
 
+#include <algorithm>
+#include <cfloat>
+#include <vector>
 #include "Util.hh"
 
 /**
@@ -37,56 +40,157 @@
  */
 namespace Sched {
     /**
-     * Callback function signatures
+     * A queue of events, each a time and a payload of type T, kept in a
+     * binary heap. Events scheduled for the same time are processed in the
+     * order in which they were scheduled. Event nodes are pooled and
+     * reused, so once the pool has grown, scheduling does not allocate.
      */
-    typedef void (*NoneCallback)(double scheduledTime,
-                                 double currentTime);
+    template <typename T>
+    class Scheduler {
+    public:
+        Scheduler() : nextSeq(0) {}
 
-    typedef void (*UintCallback)(double scheduledTime,
-                                 double currentTime,
-                                 uint data);
+        /**
+         * Schedule an event
+         * @param time Time for which the event will be scheduled
+         * @param payload Passed to the handler when the event is processed
+         */
+        void schedule(double time, const T &payload)
+        {
+            uint n;
+            if (freeNodes.empty()) {
+                n = pool.size();
+                pool.push_back(Node());
+            } else {
+                n = freeNodes.back();
+                freeNodes.pop_back();
+            }
+            pool[n].time    = time;
+            pool[n].seq     = nextSeq++;
+            pool[n].payload = payload;
+            heap.push_back(n);
+            siftUp(heap.size() - 1);
+        }
 
-    typedef void (*DbleCallback)(double scheduledTime,
-                                 double currentTime,
-                                 double data);
+        bool   empty() const { return heap.empty(); }
+        size_t size() const  { return heap.size(); }
 
-    typedef void (*VoidPtrCallback)(double scheduledTime,
-                                 double currentTime,
-                                 void *data);
-    /**
-     * Schedule an event
-     * @param time Time for which event will be scheduled
-     * @param cb Callback function
-     * @param data Will be passed as parameter to cb
-     */
-    void scheduleEvent(
-        double time, 
-        NoneCallback cb);
+        /**
+         * Time of the next event, or DBL_MAX if there is none
+         */
+        double peekNextTime() const
+        {
+            return heap.empty() ? DBL_MAX : pool[heap[0]].time;
+        }
 
-    void scheduleEvent(
-        double time, 
-        UintCallback cb,
-        uint data);
+        /**
+         * Process all events scheduled at or before the specified time, in
+         * order. Each event is removed before its handler is called, so the
+         * handler may schedule further events.
+         * @param handler Called as handler(time, payload)
+         */
+        template <typename F>
+        void processEvents(double now, F handler)
+        {
+            while (!heap.empty() && pool[heap[0]].time <= now) {
+                uint n = heap[0];
+                double time = pool[n].time;
+                T payload = pool[n].payload;
+                removeTop();
+                handler(time, payload);
+            }
+        }
 
-    void scheduleEvent(
-        double time, 
-        DbleCallback cb,
-        double data);
+        /**
+         * Get the pending events' payloads, in the order in which they
+         * will be processed
+         */
+        std::vector<T> getPending() const
+        {
+            std::vector<uint> order(heap);
+            std::sort(order.begin(), order.end(),
+                      [this](uint a, uint b) { return before(a, b); });
+            std::vector<T> pending;
+            for (auto n : order) {
+                pending.push_back(pool[n].payload);
+            }
+            return pending;
+        }
 
-    void scheduleEvent(
-        double time, 
-        VoidPtrCallback cb,
-        void *data);
+        /**
+         * Remove all scheduled events
+         */
+        void clear()
+        {
+            pool.clear();
+            freeNodes.clear();
+            heap.clear();
+        }
 
-    /**
-     * Clear all scheduled events
-     */
-    void clearEvents();
+    private:
+        struct Node {
+            double   time;
+            uint64_t seq;       // scheduling order, for equal times
+            T        payload;
+        };
 
-    /**
-     * Process all events scheduled to run at or before the specified time
-     */
-    void processEvents(double time);
+        std::vector<Node> pool;
+        std::vector<uint> freeNodes;    // unused nodes in pool
+        std::vector<uint> heap;         // indexes into pool
+        uint64_t nextSeq;
+
+        bool before(uint a, uint b) const
+        {
+            return pool[a].time < pool[b].time ||
+                (pool[a].time == pool[b].time && pool[a].seq < pool[b].seq);
+        }
+
+        void siftUp(size_t i)
+        {
+            uint n = heap[i];
+            while (i > 0) {
+                size_t parent = (i - 1) / 2;
+                if (!before(n, heap[parent])) {
+                    break;
+                }
+                heap[i] = heap[parent];
+                i = parent;
+            }
+            heap[i] = n;
+        }
+
+        void siftDown(size_t i)
+        {
+            uint n = heap[i];
+            for (;;) {
+                size_t child = 2 * i + 1;
+                if (child >= heap.size()) {
+                    break;
+                }
+                if (child + 1 < heap.size() &&
+                    before(heap[child + 1], heap[child]))
+                {
+                    child++;
+                }
+                if (!before(heap[child], n)) {
+                    break;
+                }
+                heap[i] = heap[child];
+                i = child;
+            }
+            heap[i] = n;
+        }
+
+        void removeTop()
+        {
+            freeNodes.push_back(heap[0]);
+            heap[0] = heap.back();
+            heap.pop_back();
+            if (!heap.empty()) {
+                siftDown(0);
+            }
+        }
+    };
 };
 
 #endif
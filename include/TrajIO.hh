@@ -0,0 +1,919 @@
+/**
+ * @file TrajIO.hh
+ *
+ * Binary trajectory files
+ *
+ * Copyright (c) 2016 - 2018, Peter Helfer
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS
+ * IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO,
+ * THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+ * PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+ * EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef TRAJIO_HH
+#define TRAJIO_HH
+
+#include <stdio.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <atomic>
+#include <vector>
+#include <string>
+using std::string;
+
+/**
+ * Binary trajectory files
+ *
+ * Both binary formats start with the same header:
+ *
+ *     char     magic[8]      BIN_MAGIC or DELTA_MAGIC
+ *     uint32_t version
+ *     uint32_t numCounts     number of count columns
+ *     double   plotInterval  0 if every step was output
+ *     uint64_t numRows       0 if unknown (see below)
+ *     uint32_t namesSize     size of the names block
+ *     uint32_t blockRows     rows per block (delta format only)
+ *     char     names[namesSize]
+ *
+ * The names block holds the NUL-terminated column names ("t" followed by
+ * the count column names), padded with NULs to a multiple of 8 bytes.
+ * All values are in native byte order.
+ *
+ * Plain binary format: the header is followed by fixed size rows, each a
+ * double time followed by numCounts uint32_t counts, padded to a multiple
+ * of 8 bytes, so that a mapped file can be accessed in place. numRows is
+ * filled in when the run ends, if the output is seekable.
+ *
+ * Delta format: the header is followed by blocks of up to blockRows rows,
+ * each consisting of
+ *
+ *     uint32_t numRows
+ *     uint32_t numBytes      size of the encoded rows
+ *     encoded rows
+ *
+ * Within a block, each row is encoded as a sequence of varints (7 bits per
+ * byte, least significant first, high bit set on all but the last byte):
+ *
+ *     timeTag                0: time is previous time + plotInterval
+ *                            1: time follows as a raw 8-byte double
+ *     numChanged             number of counts that differ from previous row
+ *     (gap, delta) ...       for each changed count: number of unchanged
+ *                            columns skipped, and the zig-zag encoded
+ *                            difference from the previous row
+ *
+ * At the start of each block, previous counts are taken to be 0, and the
+ * time is always given explicitly, so that blocks can be decoded
+ * independently. After the last block, a trailer indexes the blocks:
+ *
+ *     uint64_t blockOffsets[numBlocks]
+ *     uint64_t numBlocks
+ *     uint64_t numRows
+ *     char     magic[8]      INDEX_MAGIC
+ *
+ * If the trailer is missing (e.g. the run was killed), readers locate the
+ * blocks by walking the block headers.
+ *
+ * Sparse format: laid out like the plain binary format, but a row is only
+ * written when some count differs from that of the last written row by
+ * more than a deadband, or when a maximum time has passed since it. The
+ * last row of the run is always written. A row's counts stand for all
+ * times up to the next row; readers expand the rows onto a grid (by
+ * default, that of the plot interval of the run) by holding them.
+ *
+ * Ensemble store: a single file that holds the trajectories of numRuns
+ * runs, written concurrently by separate processes. Each species' counts
+ * for all runs and times are contiguous, so that a species can be read
+ * across runs sequentially:
+ *
+ *     char     magic[8]      ENSEMBLE_MAGIC
+ *     uint32_t version
+ *     uint32_t numSpecies
+ *     uint32_t numRuns
+ *     uint32_t numTimes
+ *     double   plotInterval
+ *     uint32_t namesSize     size of the names block
+ *     uint32_t reserved
+ *     char     names[namesSize]   species names, as above (no "t")
+ *     uint64_t speciesOffsets[numSpecies]
+ *     double   times[numTimes]
+ *     uint8_t  done[numRuns]      padded to a multiple of 8 bytes
+ *     uint32_t counts[numSpecies][numRuns][numTimes]
+ *
+ * speciesOffsets is the directory: the file offset of each species'
+ * [numRuns][numTimes] array. done[r] is set to 1 once run r is complete.
+ *
+ * Event log: the common header (with numRows 0) is followed by
+ *
+ *     uint32_t numReactions
+ *     int32_t  deltas[numReactions][numCounts]   stoichiometry
+ *     uint32_t initialCounts[numCounts]
+ *
+ * and then by a sequence of records, each a varint tag followed by
+ *
+ *     tag 0:        double time                       end of run
+ *     tag 1:        varint col, varint count, double time      setCount
+ *     tag 2:        varint reaction, double level, double time setInhib
+ *     tag 3 + r:    double time                       reaction r fired
+ *
+ * Record times are those at which the simulation applied the change.
+ * The state at time p results from all records with time < p, and those
+ * with time 0. The end record gives the time up to which the run produced
+ * output; if it is missing (e.g. the run was killed), the time of the
+ * last record is used.
+ */
+namespace TrajIO {
+    const char BIN_MAGIC[8]   = { '\x89', 'G', 'I', 'L', 'B', 'I', 'N', '\n' };
+    const char DELTA_MAGIC[8] = { '\x89', 'G', 'I', 'L', 'D', 'L', 'T', '\n' };
+    const char INDEX_MAGIC[8] = { '\x89', 'G', 'I', 'L', 'I', 'D', 'X', '\n' };
+    const char ENSEMBLE_MAGIC[8] =
+        { '\x89', 'G', 'I', 'L', 'E', 'N', 'S', '\n' };
+    const char EVENT_MAGIC[8] = { '\x89', 'G', 'I', 'L', 'E', 'V', 'T', '\n' };
+    const char SPARSE_MAGIC[8] =
+        { '\x89', 'G', 'I', 'L', 'S', 'P', 'R', '\n' };
+    const uint32_t VERSION = 1;
+
+    /**
+     * Whether a file is a binary trajectory file. Only the first byte,
+     * which cannot start a text file, is examined and then pushed back,
+     * so this works on pipes too.
+     */
+    bool isTrajFile(FILE *fp);
+
+    /**
+     * Trajectory writer base class
+     */
+    class Writer {
+    public:
+        /**
+         * Constructor
+         * @param fp Output stream
+         * @param names Column names, starting with the time column
+         * @param plotInterval Time between rows
+         */
+        Writer(
+            FILE *fp,
+            const std::vector<string> &names,
+            double plotInterval);
+
+        virtual ~Writer() {}
+
+        /**
+         * Change the output stream
+         */
+        virtual void setFile(FILE *fp) { this->fp = fp; }
+
+        /**
+         * Write the file header. Not done when continuing output whose
+         * header has already been written.
+         */
+        virtual void writeHeader() = 0;
+
+        /**
+         * Set a count for the next row
+         * @param col Count column (0 is the first column after time)
+         */
+        void setCount(uint col, uint32_t count)
+        {
+            counts[col] = count;
+        }
+
+        /**
+         * Write a row consisting of time and the counts set so far
+         */
+        virtual void writeRow(double time) = 0;
+
+        /**
+         * Complete the file at the end of a run
+         */
+        virtual void finish() = 0;
+
+        /**
+         * Wait until all rows written so far have been passed on to the
+         * output stream (or, for Writers that hold output back, to the
+         * state captured by saveState)
+         */
+        virtual void sync() {}
+
+        /**
+         * Capture any state needed to continue the output in another
+         * Writer (e.g. after restart from a checkpoint). Output not yet
+         * written to the stream is part of the state.
+         */
+        virtual void saveState(std::vector<char> &state) const
+        {
+            state.clear();
+        }
+
+        /**
+         * Continue from a state captured by saveState
+         * @return false if the state is invalid
+         */
+        virtual bool restoreState(const std::vector<char> &state)
+        {
+            return state.empty();
+        }
+
+    protected:
+        FILE *fp;
+        std::vector<string> names;
+        double plotInterval;
+        std::vector<uint32_t> counts;
+
+        /**
+         * Write the common file header
+         * @return Size of the header
+         */
+        size_t writeFileHeader(const char magic[8], uint32_t blockRows);
+
+        /**
+         * Size of the common file header
+         */
+        size_t fileHeaderSize() const;
+    };
+
+    /**
+     * Writes the text format: a header line and rows of right-aligned
+     * columns, the time with 4 decimals. Rows are formatted into a buffer
+     * that is written out in large blocks, bypassing stdio.
+     */
+    class TextWriter : public Writer {
+    public:
+        /**
+         * Constructor
+         * @param widths Column widths, starting with the time column
+         * @param decimals Number of decimals of the counts, which are
+         *        then fixed-point numbers, e.g. 1234 is written as 12.34
+         *        with 2 decimals
+         */
+        TextWriter(
+            FILE *fp,
+            const std::vector<string> &names,
+            double plotInterval,
+            const std::vector<uint> &widths,
+            uint decimals = 0);
+
+        void writeHeader();
+        void writeRow(double time);
+        void finish();
+        void saveState(std::vector<char> &state) const;
+        bool restoreState(const std::vector<char> &state);
+
+    private:
+        static const size_t BUF_SIZE = 1 << 16;
+
+        std::vector<uint> widths;
+        uint decimals;
+        std::vector<char> buf;
+        size_t len;
+        size_t maxRowLen;
+
+        char *putTime(char *p, double time);
+        void flush();
+    };
+
+    /**
+     * Writes the plain binary format
+     */
+    class BinWriter : public Writer {
+    public:
+        BinWriter(
+            FILE *fp,
+            const std::vector<string> &names,
+            double plotInterval);
+
+        void writeHeader();
+        void writeRow(double time);
+
+        /**
+         * Record the number of rows in the header, if the output is
+         * seekable. The number is derived from the current file position,
+         * so that it includes rows written by an earlier process.
+         */
+        void finish();
+
+    private:
+        std::vector<char> row;
+    };
+
+    /**
+     * Writes the sparse format, from rows at every plot time
+     */
+    class SparseWriter : public BinWriter {
+    public:
+        /**
+         * Constructor
+         * @param deadband A row is written when a count differs from the
+         *        last written one by more than this
+         * @param maxGap A row is written when this much time has passed
+         *        since the last written one; 0 means no limit
+         */
+        SparseWriter(
+            FILE *fp,
+            const std::vector<string> &names,
+            double plotInterval,
+            uint32_t deadband,
+            double maxGap);
+
+        void writeHeader();
+        void writeRow(double time);
+
+        /**
+         * Write the last row, if it was held back, and the row count
+         */
+        void finish();
+
+        void saveState(std::vector<char> &state) const;
+        bool restoreState(const std::vector<char> &state);
+
+    private:
+        uint32_t deadband;
+        double   maxGap;
+        uint8_t  haveLast;              // a row has been written
+        std::vector<uint32_t> last;     // last written row's counts
+        double   lastTime;
+        uint8_t  pending;               // a row has been held back
+        std::vector<uint32_t> held;     // last held back row's counts
+        double   heldTime;
+    };
+
+    /**
+     * Writes the delta format
+     */
+    class DeltaWriter : public Writer {
+    public:
+        enum { BLOCK_ROWS = 256 };
+
+        DeltaWriter(
+            FILE *fp,
+            const std::vector<string> &names,
+            double plotInterval);
+
+        void writeHeader();
+        void writeRow(double time);
+
+        /**
+         * Write the last block and the block index
+         */
+        void finish();
+
+        void saveState(std::vector<char> &state) const;
+        bool restoreState(const std::vector<char> &state);
+
+    private:
+        uint64_t numRows;               // rows written, including pending
+        uint64_t offset;                // file offset of the pending block
+        std::vector<uint64_t> blockOffsets;
+        uint32_t blockRowCount;         // rows in the pending block
+        std::vector<uint8_t> block;     // encoded rows of pending block
+        std::vector<uint32_t> prev;     // previous row's counts
+        double prevTime;
+
+        void putVarint(uint64_t v);
+        void flushBlock();
+    };
+
+    /**
+     * Writes one run into an ensemble store. Rows are collected in memory
+     * and written, species by species, when the run finishes.
+     */
+    class EnsembleWriter : public Writer {
+    public:
+        /**
+         * Constructor
+         * @param fileName Ensemble store
+         * @param run This run's number, 0 .. numRuns - 1
+         * @param numRuns Number of runs in the store
+         * @param numTimes Number of rows per run. Rows beyond this are
+         *        ignored; if a run ends early, its last row is repeated.
+         * @param names Column names, starting with the time column
+         * @param plotInterval Time between rows
+         */
+        EnsembleWriter(
+            const string &fileName,
+            uint run,
+            uint numRuns,
+            uint numTimes,
+            const std::vector<string> &names,
+            double plotInterval);
+
+        /**
+         * Create the store, or check that an existing one (created by
+         * another run) matches. Exits with a message on mismatch.
+         */
+        void writeHeader();
+
+        void writeRow(double time);
+
+        /**
+         * Write this run's counts and mark it done
+         */
+        void finish();
+
+        void saveState(std::vector<char> &state) const;
+        bool restoreState(const std::vector<char> &state);
+
+    private:
+        string   fileName;
+        uint32_t run;
+        uint32_t numRuns;
+        uint32_t numTimes;
+        uint32_t rowCount;
+        std::vector<uint32_t> series;   // [species][time]
+    };
+
+    /**
+     * Writes an event log. Rows are not written; instead, the simulation
+     * reports each change of state.
+     */
+    class EventWriter : public Writer {
+    public:
+        /**
+         * Constructor
+         * @param fp Output stream
+         * @param names Column names, starting with the time column
+         * @param plotInterval Default time between rows when reading
+         * @param deltas Change of each count by each reaction
+         */
+        EventWriter(
+            FILE *fp,
+            const std::vector<string> &names,
+            double plotInterval,
+            const std::vector<std::vector<int>> &deltas);
+
+        /**
+         * Write the header, with the counts set so far as initial counts
+         */
+        void writeHeader();
+
+        void writeRow(double time) {}
+
+        /**
+         * Write the end record
+         */
+        void finish();
+
+        /**
+         * Log a reaction; not done for reactions that don't change any
+         * of the counts
+         */
+        void logReaction(double time, uint reaction)
+        {
+            if (!changesCounts[reaction]) {
+                return;
+            }
+            putVarint(3 + reaction);
+            putTime(time);
+        }
+
+        void logSetCount(double time, uint col, uint32_t count)
+        {
+            putVarint(1);
+            putVarint(col);
+            putVarint(count);
+            putTime(time);
+        }
+
+        void logSetInhib(double time, uint reaction, double level);
+
+        /**
+         * Set the time up to which the run produced output, for the end
+         * record
+         */
+        void setEndTime(double time) { endTime = time; }
+
+    private:
+        std::vector<std::vector<int>> deltas;
+        std::vector<bool> changesCounts; // per reaction
+        double endTime;
+
+        void putVarint(uint64_t v)
+        {
+            while (v >= 0x80) {
+                putc((int) (v | 0x80) & 0xff, fp);
+                v >>= 7;
+            }
+            putc((int) v, fp);
+        }
+
+        void putTime(double time)
+        {
+            fwrite(&time, sizeof(time), 1, fp);
+        }
+    };
+
+    /**
+     * Accumulates the mean, standard deviation, minimum and maximum of
+     * each count over the rows, and writes them as a table at the end of
+     * the run
+     */
+    class StatsWriter : public Writer {
+    public:
+        StatsWriter(
+            FILE *fp,
+            const std::vector<string> &names,
+            double plotInterval);
+
+        void writeHeader() {}
+        void writeRow(double time);
+        void finish();
+        void saveState(std::vector<char> &state) const;
+        bool restoreState(const std::vector<char> &state);
+
+        uint64_t getNumRows() const { return numRows; }
+        double getMean(uint col) const;
+        double getStdev(uint col) const;
+        uint32_t getMin(uint col) const { return min[col]; }
+        uint32_t getMax(uint col) const { return max[col]; }
+
+    private:
+        uint64_t numRows;
+        std::vector<double> sum;
+        std::vector<double> sumSq;
+        std::vector<uint32_t> min;
+        std::vector<uint32_t> max;
+    };
+
+    /**
+     * Accumulates time-weighted statistics of each count over a single
+     * long run, after a burn-in: mean, standard deviation, a 95%
+     * confidence interval for the mean from batch means, and the
+     * fraction of the time spent at each count. A row's counts are taken
+     * to hold until the next row, which is exact with rows at every
+     * reaction (-npp 0). Writes them at the end of the run.
+     */
+    class ErgodicWriter : public Writer {
+    public:
+        /**
+         * Constructor
+         * @param burnIn Time before which rows are ignored
+         * @param endTime End of the run
+         * @param numBatches Number of batches of equal duration that
+         *        [burnIn, endTime] is divided into, for the confidence
+         *        interval
+         */
+        ErgodicWriter(
+            FILE *fp,
+            const std::vector<string> &names,
+            double plotInterval,
+            double burnIn,
+            double endTime,
+            uint numBatches);
+
+        void writeHeader() {}
+        void writeRow(double time);
+        void finish();
+        void saveState(std::vector<char> &state) const;
+        bool restoreState(const std::vector<char> &state);
+
+    private:
+        double burnIn;
+        double endTime;
+        uint   numBatches;
+        double lastTime;               // time of the pending row
+        std::vector<uint32_t> last;    // counts of the pending row
+        std::vector<double> area;      // integral of each count
+        std::vector<double> areaSq;    // of its square
+        std::vector<double> batchArea; // per batch, then column
+        std::vector<double> batchTime; // per batch
+        std::vector<std::vector<double>> hist; // time at each count
+
+        /**
+         * Add the pending row's counts over [from, to)
+         */
+        void add(double from, double to);
+    };
+
+    /**
+     * Passes rows on to one or more other Writers (sinks) on a separate
+     * thread, through a lock-free single producer, single consumer ring
+     * buffer, so that the simulation only waits for formatting and I/O
+     * when the ring is full. The sinks are called on the consumer thread
+     * for rows, and on the caller's thread (after a sync) for everything
+     * else. On a single CPU, where the thread would only add overhead,
+     * rows are passed on directly instead.
+     */
+    class AsyncWriter : public Writer {
+    public:
+        /**
+         * Constructor
+         * @param sinks Writers to pass rows on to; AsyncWriter deletes
+         *        them when it is deleted
+         * @param threaded Use a consumer thread; by default, if there is
+         *        more than one CPU
+         */
+        AsyncWriter(
+            const std::vector<Writer *> &sinks,
+            const std::vector<string> &names,
+            double plotInterval,
+            bool threaded = sysconf(_SC_NPROCESSORS_ONLN) > 1);
+
+        ~AsyncWriter();
+
+        /**
+         * Change the output stream of the first sink
+         */
+        void setFile(FILE *fp);
+
+        void writeHeader();
+        void writeRow(double time);
+        void finish();
+        void sync();
+        void saveState(std::vector<char> &state) const;
+        bool restoreState(const std::vector<char> &state);
+
+    private:
+        static const uint RING_ROWS = 4096;
+
+        std::vector<Writer *> sinks;
+        bool threaded;
+        size_t slotSize;
+        std::vector<char> ring;
+
+        std::atomic<uint64_t> head;     // next row to be consumed
+        std::atomic<uint64_t> tail;     // next row to be produced
+        std::atomic<bool> waiting;      // consumer is (about to be) asleep
+        std::atomic<bool> stopping;
+        pthread_mutex_t mutex;
+        pthread_cond_t cond;
+        pthread_t thread;
+
+        static void *threadMain(void *arg);
+        void consume();
+        void wake();
+    };
+
+    /**
+     * Trajectory reader base class. Regular files are mapped into memory;
+     * other inputs (e.g. pipes) are read into memory.
+     */
+    class Reader {
+    public:
+        virtual ~Reader();
+
+        /**
+         * Column names, starting with the time column
+         */
+        const std::vector<string> &getNames() const { return names; }
+
+        uint     getNumCounts() const    { return numCounts; }
+        uint64_t getNumRows() const      { return numRows; }
+        double   getPlotInterval() const { return plotInterval; }
+
+        /**
+         * Choose the times at which rows are produced, for formats that
+         * are not stored as rows
+         * @param interval Time between rows; 0 means a row for every
+         *        recorded change
+         * @return false if the format does not support this
+         */
+        virtual bool setGrid(double interval) { return false; }
+
+        /**
+         * Read a row. Reading rows in sequence is fastest.
+         * @param row Row number
+         * @param counts Set to the row's numCounts counts
+         * @return The row's time
+         */
+        virtual double getRow(uint64_t row, uint32_t *counts) = 0;
+
+    protected:
+        std::vector<string> names;
+        uint     numCounts;
+        uint64_t numRows;
+        double   plotInterval;
+        uint32_t blockRows;
+        const char *data;       // file contents
+        size_t   size;
+        size_t   headerSize;
+
+        Reader();
+
+        /**
+         * Parse the format-specific part of the file, after the header
+         */
+        virtual bool parse(const char *fname, string &errMsg) = 0;
+
+    private:
+        void   *mapAddr;        // mapped file, if mapped
+        size_t mapSize;
+        std::vector<char> buf;  // file contents, if not mapped
+
+        bool load(const char *fname, FILE *fp, string &errMsg);
+        bool parseHeader(const char *fname, string &errMsg);
+
+        Reader(const Reader &);
+        Reader &operator=(const Reader &);
+
+        friend Reader *openReader(const char *, FILE *, string &);
+    };
+
+    /**
+     * Reads the plain binary format
+     */
+    class BinReader : public Reader {
+    public:
+        double getTime(uint64_t row) const
+        {
+            return *(const double *) (rows + row * rowSize);
+        }
+
+        /**
+         * Counts of a row, numCounts of them
+         */
+        const uint32_t *getCounts(uint64_t row) const
+        {
+            return (const uint32_t *) (rows + row * rowSize + sizeof(double));
+        }
+
+        double getRow(uint64_t row, uint32_t *counts);
+
+    protected:
+        bool parse(const char *fname, string &errMsg);
+
+    private:
+        size_t rowSize;
+        const char *rows;
+    };
+
+    /**
+     * Reads the sparse format, holding the counts of each row until the
+     * next, at the times of a grid (by default, that of the plot interval
+     * of the run)
+     */
+    class SparseReader : public BinReader {
+    public:
+        bool setGrid(double interval);
+        double getRow(uint64_t row, uint32_t *counts);
+
+    protected:
+        bool parse(const char *fname, string &errMsg);
+
+    private:
+        uint64_t numStored;             // rows in the file
+        std::vector<double> grid;
+        double   tolerance;             // for comparing grid and row times
+        uint64_t cur;                   // stored row of the last grid row
+    };
+
+    /**
+     * Reads the delta format
+     */
+    class DeltaReader : public Reader {
+    public:
+        double getRow(uint64_t row, uint32_t *counts);
+
+    protected:
+        bool parse(const char *fname, string &errMsg);
+
+    private:
+        std::vector<uint64_t> blockOffsets;
+        std::vector<uint64_t> blockFirstRows;
+
+        // Decoding position
+        //
+        uint     curBlock;
+        uint64_t curRow;        // next row to be decoded
+        const uint8_t *pos;
+        const uint8_t *blockEnd;
+        std::vector<uint32_t> cur;
+        double   curTime;
+
+        void seekBlock(uint b);
+        void decodeRow();
+        uint64_t getVarint();
+    };
+
+    /**
+     * Reads an event log, reconstructing the counts at the times of a
+     * grid (by default, that of the plot interval of the run)
+     */
+    class EventReader : public Reader {
+    public:
+        bool setGrid(double interval);
+        double getRow(uint64_t row, uint32_t *counts);
+
+    protected:
+        bool parse(const char *fname, string &errMsg);
+
+    private:
+        std::vector<int32_t>  deltas;     // [reaction][col]
+        std::vector<uint32_t> initial;
+        uint     numReactions;
+        const uint8_t *first;             // first record
+        const uint8_t *end;               // end of file
+        double   endTime;
+        std::vector<double> grid;
+
+        // Replay position
+        //
+        const uint8_t *pos;
+        std::vector<uint32_t> cur;
+        uint64_t curRow;                  // next row to be produced
+
+        /**
+         * Decode the record at p
+         * @return false at the end of the records
+         */
+        bool decode(
+            const uint8_t *&p,
+            uint64_t &tag,
+            uint64_t &a,
+            uint64_t &b,
+            double &time) const;
+        void rewind();
+    };
+
+    /**
+     * Reads an ensemble store. The file is mapped shared, so runs that
+     * complete while it is open become visible.
+     */
+    class EnsembleReader {
+    public:
+        EnsembleReader();
+        ~EnsembleReader();
+
+        /**
+         * Open an ensemble store
+         * @param errMsg Set to a description of the problem, if any
+         * @return true if successful
+         */
+        bool open(const char *fname, string &errMsg);
+
+        /**
+         * Species names
+         */
+        const std::vector<string> &getNames() const { return names; }
+
+        uint   getNumSpecies() const   { return names.size(); }
+        uint   getNumRuns() const      { return numRuns; }
+        uint   getNumTimes() const     { return numTimes; }
+        double getPlotInterval() const { return plotInterval; }
+        double getTime(uint i) const   { return times[i]; }
+        bool   isDone(uint run) const  { return done[run] != 0; }
+
+        /**
+         * Index of a species, or -1 if there is none by that name
+         */
+        int speciesIndex(const string &name) const;
+
+        /**
+         * Index of the first time not less than t (allowing for rounding),
+         * or numTimes if there is none
+         */
+        uint timeIndex(double t) const;
+
+        /**
+         * Counts of a species in a run, numTimes of them
+         */
+        const uint32_t *getSeries(uint species, uint run) const
+        {
+            return (const uint32_t *) (data + speciesOffsets[species]) +
+                (size_t) run * numTimes;
+        }
+
+    private:
+        std::vector<string> names;
+        uint   numRuns;
+        uint   numTimes;
+        double plotInterval;
+        const uint64_t *speciesOffsets;
+        const double   *times;
+        const volatile uint8_t *done;
+        const char *data;
+        size_t size;
+
+        EnsembleReader(const EnsembleReader &);
+        EnsembleReader &operator=(const EnsembleReader &);
+    };
+
+    /**
+     * Open a trajectory file of any binary format
+     * @param fname File name (for diagnostics)
+     * @param fp File pointer, positioned at the start of the file
+     * @param errMsg Set to a description of the problem, if any
+     * @return A reader (to be deleted by the caller), or NULL on error
+     */
+    Reader *openReader(const char *fname, FILE *fp, string &errMsg);
+};
+
+#endif
@@ -513,6 +513,11 @@ namespace Util {
     //
     uint binom(uint n, uint k);
 
+    // 97.5% quantile of Student's t distribution with df degrees of
+    // freedom: NAN for 0, the normal quantile for more than 30
+    //
+    double tQuantile(uint df);
+
 
     /**
      * Quick fmtlib formats for printing out matrices
@@ -0,0 +1,258 @@
+/**
+ * @file Rng.cc
+ *
+ * Implementation of buffered random number generator
+ *
+ * Copyright (c) 2016 - 2018, Peter Helfer
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS
+ * IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO,
+ * THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+ * PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+ * EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <math.h>
+#include <sys/time.h>
+#include <unistd.h>
+
+#include "Rng.hh"
+
+/**
+ * 2^53 and its inverse, for converting 53-bit integers to doubles
+ */
+static const double TWO_53 = 9007199254740992.0;
+static const double INV_TWO_53 = 1.0 / TWO_53;
+
+/**
+ * Jump polynomials for xoshiro256 (see Blackman & Vigna 2018)
+ */
+static const uint64_t JUMP[4] = {
+    0x180ec6d33cfd0abaULL, 0xd5a61266f0c9392cULL,
+    0xa9582618e03fc9aaULL, 0x39abdc4529b1661cULL
+};
+static const uint64_t LONG_JUMP[4] = {
+    0x76e15d3efefdcbbfULL, 0xc5004e441c522fb3ULL,
+    0x77710069854ee241ULL, 0x39109bb02acbe635ULL
+};
+
+static inline uint64_t rotl(uint64_t x, int k)
+{
+    return (x << k) | (x >> (64 - k));
+}
+
+/**
+ * splitmix64, used to expand a seed into generator state
+ */
+static inline uint64_t splitmix64(uint64_t &x)
+{
+    uint64_t z = (x += 0x9e3779b97f4a7c15ULL);
+    z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+    return z ^ (z >> 31);
+}
+
+/**
+ * Ziggurat tables for the exponential distribution, 256 layers.
+ * (Marsaglia & Tsang 2000, scaled for 53-bit integers)
+ */
+static const double ZIG_R = 7.69711747013104972;
+
+static struct ZigTables {
+    uint64_t ke[256];
+    double   we[256];
+    double   fe[256];
+
+    ZigTables()
+    {
+        const double ve = 3.949659822581572e-3;
+        double de = ZIG_R;
+        double te = de;
+        double q = ve / exp(-de);
+
+        ke[0] = (uint64_t) ((de / q) * TWO_53);
+        ke[1] = 0;
+        we[0] = q / TWO_53;
+        we[255] = de / TWO_53;
+        fe[0] = 1.0;
+        fe[255] = exp(-de);
+
+        for (int i = 254; i >= 1; i--) {
+            de = -log(ve / de + exp(-de));
+            ke[i + 1] = (uint64_t) ((de / te) * TWO_53);
+            te = de;
+            fe[i] = exp(-de);
+            we[i] = de / TWO_53;
+        }
+    }
+} zig;
+
+void Rng::setSeed(uint64_t seed)
+{
+    uint64_t x = seed;
+    for (uint i = 0; i < 4; i++) {
+        s[i][0] = splitmix64(x);
+    }
+    for (uint lane = 1; lane < LANES; lane++) {
+        for (uint i = 0; i < 4; i++) {
+            s[i][lane] = s[i][lane - 1];
+        }
+        jump(JUMP, lane);
+    }
+    rawPos = uPos = ePos = BLOCK;
+}
+
+uint64_t Rng::seedFromClock()
+{
+    struct timeval now;
+    gettimeofday(&now, 0);
+    uint64_t seed = (uint64_t) now.tv_sec * 1000000 + now.tv_usec;
+    seed ^= (uint64_t) getpid() << 40;
+    setSeed(seed);
+    return seed;
+}
+
+/**
+ * Advance one lane by the number of draws encoded in poly
+ */
+void Rng::jump(const uint64_t poly[4], uint lane)
+{
+    uint64_t s0 = 0, s1 = 0, s2 = 0, s3 = 0;
+    for (uint i = 0; i < 4; i++) {
+        for (uint b = 0; b < 64; b++) {
+            if (poly[i] & (1ULL << b)) {
+                s0 ^= s[0][lane];
+                s1 ^= s[1][lane];
+                s2 ^= s[2][lane];
+                s3 ^= s[3][lane];
+            }
+            uint64_t t = s[1][lane] << 17;
+            s[2][lane] ^= s[0][lane];
+            s[3][lane] ^= s[1][lane];
+            s[1][lane] ^= s[2][lane];
+            s[0][lane] ^= s[3][lane];
+            s[2][lane] ^= t;
+            s[3][lane] = rotl(s[3][lane], 45);
+        }
+    }
+    s[0][lane] = s0;
+    s[1][lane] = s1;
+    s[2][lane] = s2;
+    s[3][lane] = s3;
+}
+
+void Rng::longJump()
+{
+    for (uint lane = 0; lane < LANES; lane++) {
+        jump(LONG_JUMP, lane);
+    }
+    rawPos = uPos = ePos = BLOCK;
+}
+
+/**
+ * Refill the raw buffer. The inner loop advances all lanes in lockstep
+ * and has no dependencies between lanes, so it vectorizes.
+ */
+void Rng::refillRaw()
+{
+    for (uint k = 0; k < BLOCK; k += LANES) {
+        for (uint l = 0; l < LANES; l++) {
+            raw[k + l] = rotl(s[0][l] + s[3][l], 23) + s[0][l];
+            uint64_t t = s[1][l] << 17;
+            s[2][l] ^= s[0][l];
+            s[3][l] ^= s[1][l];
+            s[1][l] ^= s[2][l];
+            s[0][l] ^= s[3][l];
+            s[2][l] ^= t;
+            s[3][l] = rotl(s[3][l], 45);
+        }
+    }
+    rawPos = 0;
+}
+
+/**
+ * Refill the uniform buffer from a fresh block of raw numbers. The top 53
+ * bits are used, offset by half a step so that 0 and 1 cannot occur.
+ */
+void Rng::refillUniform()
+{
+    refillRaw();
+    for (uint i = 0; i < BLOCK; i++) {
+        uBuf[i] = ((raw[i] >> 11) + 0.5) * INV_TWO_53;
+    }
+    rawPos = BLOCK;
+    uPos = 0;
+}
+
+/**
+ * Draw one exponential variate by the ziggurat method. The layer index
+ * comes from the low 8 bits of a raw number and the abscissa from its top
+ * 53 bits. Almost all draws take the fast path.
+ */
+double Rng::zigguratExp()
+{
+    uint64_t x = nextRaw();
+    uint i = x & 0xff;
+    uint64_t j = x >> 11;
+
+    if (j < zig.ke[i]) {
+        return j * zig.we[i];
+    }
+
+    for (;;) {
+        double u = ((nextRaw() >> 11) + 0.5) * INV_TWO_53;
+        if (i == 0) {
+            // Tail: the exponential is memoryless
+            return ZIG_R - log(u);
+        }
+        double e = j * zig.we[i];
+        if (zig.fe[i] + u * (zig.fe[i - 1] - zig.fe[i]) < exp(-e)) {
+            return e;
+        }
+        x = nextRaw();
+        i = x & 0xff;
+        j = x >> 11;
+        if (j < zig.ke[i]) {
+            return j * zig.we[i];
+        }
+    }
+}
+
+void Rng::refillExponential()
+{
+    for (uint i = 0; i < BLOCK; i++) {
+        double e;
+        do {
+            e = zigguratExp();
+        } while (e == 0.0);
+        eBuf[i] = e;
+    }
+    ePos = 0;
+}
+
+bool Rng::save(FILE *fp) const
+{
+    return fwrite(this, sizeof(*this), 1, fp) == 1;
+}
+
+bool Rng::restore(FILE *fp)
+{
+    return fread(this, sizeof(*this), 1, fp) == 1;
+}
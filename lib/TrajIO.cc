@@ -0,0 +1,1922 @@
+/**
+ * @file TrajIO.cc
+ *
+ * Implementation of binary trajectory files
+ *
+ * Copyright (c) 2016 - 2018, Peter Helfer
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS
+ * IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO,
+ * THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+ * PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+ * EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stddef.h>
+#include <string.h>
+#include <unistd.h>
+#include <sched.h>
+#include <algorithm>
+#include <cfloat>
+#include <cmath>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <format.h>
+#include "Trace.hh"
+#include "Util.hh"
+#include "TrajIO.hh"
+
+namespace TrajIO {
+    /**
+     * Fixed part of the header
+     */
+    struct FileHeader {
+        char     magic[8];
+        uint32_t version;
+        uint32_t numCounts;
+        double   plotInterval;
+        uint64_t numRows;
+        uint32_t namesSize;
+        uint32_t blockRows;
+    };
+
+    /**
+     * Block header of the delta format
+     */
+    struct BlockHeader {
+        uint32_t numRows;
+        uint32_t numBytes;
+    };
+
+    /**
+     * Fixed part of the delta format trailer
+     */
+    struct Trailer {
+        uint64_t numBlocks;
+        uint64_t numRows;
+        char     magic[8];
+    };
+
+    /**
+     * Fixed part of the ensemble store header
+     */
+    struct EnsembleHeader {
+        char     magic[8];
+        uint32_t version;
+        uint32_t numSpecies;
+        uint32_t numRuns;
+        uint32_t numTimes;
+        double   plotInterval;
+        uint32_t namesSize;
+        uint32_t reserved;
+    };
+
+    static size_t pad8(size_t n)
+    {
+        return (n + 7) & ~(size_t) 7;
+    }
+
+    /**
+     * Offsets of the parts of an ensemble store
+     */
+    struct EnsembleLayout {
+        size_t names;
+        size_t directory;
+        size_t times;
+        size_t done;
+        size_t data;
+        size_t speciesSize;     // size of one species' array
+        size_t total;
+
+        EnsembleLayout(
+            size_t namesSize,
+            uint numSpecies,
+            uint numRuns,
+            uint numTimes)
+        {
+            names       = sizeof(EnsembleHeader);
+            directory   = names + namesSize;
+            times       = directory + numSpecies * sizeof(uint64_t);
+            done        = times + numTimes * sizeof(double);
+            data        = done + pad8(numRuns);
+            speciesSize = pad8((size_t) numRuns * numTimes * sizeof(uint32_t));
+            total       = data + numSpecies * speciesSize;
+        }
+    };
+
+    static inline uint64_t zigzag(int64_t v)
+    {
+        return ((uint64_t) v << 1) ^ (uint64_t) (v >> 63);
+    }
+
+    static inline int64_t unzigzag(uint64_t v)
+    {
+        return (int64_t) (v >> 1) ^ -(int64_t) (v & 1);
+    }
+
+    bool isTrajFile(FILE *fp)
+    {
+        int c = getc(fp);
+        if (c == EOF) {
+            return false;
+        }
+        ungetc(c, fp);
+        return c == (unsigned char) BIN_MAGIC[0];
+    }
+
+    // ------------------------------------------------------------------
+    // Writers
+    // ------------------------------------------------------------------
+
+    Writer::Writer(
+        FILE *fp,
+        const std::vector<string> &names,
+        double plotInterval)
+        : fp(fp),
+          names(names),
+          plotInterval(plotInterval),
+          counts(names.size() - 1, 0)
+    {}
+
+    size_t Writer::fileHeaderSize() const
+    {
+        size_t namesSize = 0;
+        for (auto &n : names) {
+            namesSize += n.size() + 1;
+        }
+        return sizeof(FileHeader) + pad8(namesSize);
+    }
+
+    size_t Writer::writeFileHeader(const char magic[8], uint32_t blockRows)
+    {
+        size_t headerSize = fileHeaderSize();
+        std::vector<char> block(headerSize - sizeof(FileHeader), '\0');
+        size_t pos = 0;
+        for (auto &n : names) {
+            memcpy(&block[pos], n.c_str(), n.size() + 1);
+            pos += n.size() + 1;
+        }
+
+        FileHeader hdr;
+        memset(&hdr, 0, sizeof(hdr));
+        memcpy(hdr.magic, magic, sizeof(hdr.magic));
+        hdr.version      = VERSION;
+        hdr.numCounts    = counts.size();
+        hdr.plotInterval = plotInterval;
+        hdr.numRows      = 0;
+        hdr.namesSize    = block.size();
+        hdr.blockRows    = blockRows;
+
+        fwrite(&hdr, sizeof(hdr), 1, fp);
+        fwrite(block.data(), block.size(), 1, fp);
+        return headerSize;
+    }
+
+    /**
+     * Decimal digit pairs, for formatting two digits at a time
+     */
+    static const char digitPairs[] =
+        "00010203040506070809101112131415161718192021222324252627282930313233"
+        "34353637383940414243444546474849505152535455565758596061626364656667"
+        "6869707172737475767778798081828384858687888990919293949596979899";
+
+    static inline uint numDigits(uint64_t v)
+    {
+        uint n = 1;
+        for (; v >= 10000; v /= 10000) {
+            n += 4;
+        }
+        return n + (v >= 10) + (v >= 100) + (v >= 1000);
+    }
+
+    /**
+     * Format v, right-aligned in a field of width w, like "{:{}}"
+     * @return End of the field
+     */
+    static inline char *putUint(char *p, uint64_t v, uint w)
+    {
+        uint n = numDigits(v);
+        if (w > n) {
+            memset(p, ' ', w - n);
+            p += w - n;
+        }
+        char *q = p + n;
+        for (; v >= 100; v /= 100) {
+            q -= 2;
+            memcpy(q, &digitPairs[2 * (v % 100)], 2);
+        }
+        if (v >= 10) {
+            memcpy(q - 2, &digitPairs[2 * v], 2);
+        } else {
+            q[-1] = '0' + v;
+        }
+        return p + n;
+    }
+
+    /**
+     * Format v as a fixed-point number with d decimals, right-aligned in
+     * a field of width w
+     * @return End of the field
+     */
+    static inline char *putFixed(char *p, uint64_t v, uint w, uint d)
+    {
+        uint64_t scale = 1;
+        for (uint i = 0; i < d; i++) {
+            scale *= 10;
+        }
+        p = putUint(p, v / scale, w > d + 1 ? w - d - 1 : 0);
+        *p++ = '.';
+        v %= scale;
+        for (uint i = d; i > 0; i--) {
+            p[i - 1] = '0' + v % 10;
+            v /= 10;
+        }
+        return p + d;
+    }
+
+    TextWriter::TextWriter(
+        FILE *fp,
+        const std::vector<string> &names,
+        double plotInterval,
+        const std::vector<uint> &widths,
+        uint decimals)
+        : Writer(fp, names, plotInterval),
+          widths(widths),
+          decimals(decimals),
+          len(0),
+          maxRowLen(1)
+    {
+        // Longest possible row: wider fields than specified only happen
+        // with times of more than 15 digits, for which snprintf is used
+        //
+        uint maxCountLen = decimals > 0 ? std::max(11U, decimals + 2) : 10U;
+        for (uint i = 0; i < widths.size(); i++) {
+            maxRowLen += std::max(widths[i], i == 0 ? 21U : maxCountLen);
+        }
+        buf.resize(std::max((size_t) BUF_SIZE, 2 * maxRowLen));
+    }
+
+    void TextWriter::writeHeader()
+    {
+        string hdr;
+        for (uint i = 0; i < names.size(); i++) {
+            if (names[i].size() < widths[i]) {
+                hdr.append(widths[i] - names[i].size(), ' ');
+            }
+            hdr += names[i];
+        }
+        hdr += '\n';
+        fputs(hdr.c_str(), fp);
+    }
+
+    /**
+     * Format time like "{:{}.4f}", i.e. like printf's "%*.4f", which
+     * rounds the exact value of time. That is done here with integer
+     * arithmetic, unless time * 10000 is too close to a rounding tie to
+     * tell which way it goes.
+     * @return End of the field
+     */
+    char *TextWriter::putTime(char *p, double time)
+    {
+        double scaled = time * 10000.0;
+        if (!std::signbit(time) && scaled < 1e15) {
+            double whole = floor(scaled);
+            double frac = scaled - whole;
+            if (fabs(frac - 0.5) > scaled * DBL_EPSILON) {
+                uint64_t v = (uint64_t) whole + (frac > 0.5);
+                uint w = widths[0];
+                p = putUint(p, v / 10000, w > 5 ? w - 5 : 0);
+                uint f = v % 10000;
+                p[0] = '.';
+                memcpy(p + 1, &digitPairs[2 * (f / 100)], 2);
+                memcpy(p + 3, &digitPairs[2 * (f % 100)], 2);
+                return p + 5;
+            }
+        }
+        size_t avail = buf.size() - (p - buf.data());
+        int n = snprintf(p, avail, "%*.4f", widths[0], time);
+        if (n < 0 || (size_t) n >= avail) {
+            TRACE_FATAL("Time %g does not fit in output buffer", time);
+        }
+        return p + n;
+    }
+
+    void TextWriter::writeRow(double time)
+    {
+        if (len + maxRowLen > buf.size()) {
+            flush();
+        }
+        char *p = putTime(&buf[len], time);
+        if (decimals == 0) {
+            for (uint c = 0; c < counts.size(); c++) {
+                p = putUint(p, counts[c], widths[c + 1]);
+            }
+        } else {
+            for (uint c = 0; c < counts.size(); c++) {
+                p = putFixed(p, counts[c], widths[c + 1], decimals);
+            }
+        }
+        *p++ = '\n';
+        len = p - buf.data();
+    }
+
+    /**
+     * Write out the buffer. Anything still buffered by stdio goes first,
+     * to keep the order of the output.
+     */
+    void TextWriter::flush()
+    {
+        fflush(fp);
+        int fd = fileno(fp);
+        if (fd < 0) {
+            // Not backed by a file descriptor (e.g. open_memstream)
+            fwrite(buf.data(), 1, len, fp);
+            fflush(fp);
+        } else {
+            for (size_t done = 0; done < len; ) {
+                ssize_t n = write(fd, &buf[done], len - done);
+                if (n < 0) {
+                    if (errno == EINTR) {
+                        continue;
+                    }
+                    TRACE_FATAL("Output write failed: %s", strerror(errno));
+                }
+                done += n;
+            }
+        }
+        len = 0;
+    }
+
+    void TextWriter::finish()
+    {
+        flush();
+    }
+
+    void TextWriter::saveState(std::vector<char> &state) const
+    {
+        state.assign(buf.begin(), buf.begin() + len);
+    }
+
+    bool TextWriter::restoreState(const std::vector<char> &state)
+    {
+        if (state.size() > buf.size()) {
+            return false;
+        }
+        std::copy(state.begin(), state.end(), buf.begin());
+        len = state.size();
+        return true;
+    }
+
+    BinWriter::BinWriter(
+        FILE *fp,
+        const std::vector<string> &names,
+        double plotInterval)
+        : Writer(fp, names, plotInterval),
+          row(pad8(sizeof(double) + counts.size() * sizeof(uint32_t)))
+    {}
+
+    void BinWriter::writeHeader()
+    {
+        writeFileHeader(BIN_MAGIC, 0);
+    }
+
+    void BinWriter::writeRow(double time)
+    {
+        memcpy(&row[0], &time, sizeof(time));
+        memcpy(&row[sizeof(time)], counts.data(),
+               counts.size() * sizeof(uint32_t));
+        fwrite(row.data(), row.size(), 1, fp);
+    }
+
+    void BinWriter::finish()
+    {
+        fflush(fp);
+        size_t headerSize = fileHeaderSize();
+        off_t end = ftello(fp);
+        if (end < (off_t) headerSize) {
+            return; // not seekable, or header not written
+        }
+        int flags = fcntl(fileno(fp), F_GETFL);
+        if (flags == -1 || (flags & O_APPEND)) {
+            return; // the update would be appended
+        }
+        uint64_t numRows = (end - headerSize) / row.size();
+        if (fseeko(fp, offsetof(FileHeader, numRows), SEEK_SET) == 0) {
+            fwrite(&numRows, sizeof(numRows), 1, fp);
+            fseeko(fp, end, SEEK_SET);
+        }
+        fflush(fp);
+    }
+
+    DeltaWriter::DeltaWriter(
+        FILE *fp,
+        const std::vector<string> &names,
+        double plotInterval)
+        : Writer(fp, names, plotInterval),
+          numRows(0),
+          offset(0),
+          blockRowCount(0),
+          prev(counts.size(), 0),
+          prevTime(0.0)
+    {}
+
+    void DeltaWriter::writeHeader()
+    {
+        offset = writeFileHeader(DELTA_MAGIC, BLOCK_ROWS);
+    }
+
+    void DeltaWriter::putVarint(uint64_t v)
+    {
+        while (v >= 0x80) {
+            block.push_back((uint8_t) (v | 0x80));
+            v >>= 7;
+        }
+        block.push_back((uint8_t) v);
+    }
+
+    void DeltaWriter::writeRow(double time)
+    {
+        if (blockRowCount == 0) {
+            std::fill(prev.begin(), prev.end(), 0);
+        }
+
+        // Time: usually exactly one plot interval after the previous row
+        //
+        if (blockRowCount != 0 && time == prevTime + plotInterval) {
+            putVarint(0);
+        } else {
+            putVarint(1);
+            const uint8_t *p = (const uint8_t *) &time;
+            block.insert(block.end(), p, p + sizeof(time));
+        }
+        prevTime = time;
+
+        // Counts: only those that changed
+        //
+        uint numChanged = 0;
+        for (uint c = 0; c < counts.size(); c++) {
+            numChanged += (counts[c] != prev[c]);
+        }
+        putVarint(numChanged);
+        uint last = 0;
+        for (uint c = 0; c < counts.size(); c++) {
+            if (counts[c] != prev[c]) {
+                putVarint(c - last);
+                putVarint(zigzag((int64_t) counts[c] - prev[c]));
+                prev[c] = counts[c];
+                last = c + 1;
+            }
+        }
+
+        numRows++;
+        if (++blockRowCount == BLOCK_ROWS) {
+            flushBlock();
+        }
+    }
+
+    void DeltaWriter::flushBlock()
+    {
+        if (blockRowCount == 0) {
+            return;
+        }
+        BlockHeader bh = { blockRowCount, (uint32_t) block.size() };
+        fwrite(&bh, sizeof(bh), 1, fp);
+        fwrite(block.data(), block.size(), 1, fp);
+
+        blockOffsets.push_back(offset);
+        offset += sizeof(bh) + block.size();
+        block.clear();
+        blockRowCount = 0;
+    }
+
+    void DeltaWriter::finish()
+    {
+        flushBlock();
+
+        fwrite(blockOffsets.data(), sizeof(uint64_t), blockOffsets.size(), fp);
+        Trailer tr;
+        tr.numBlocks = blockOffsets.size();
+        tr.numRows = numRows;
+        memcpy(tr.magic, INDEX_MAGIC, sizeof(tr.magic));
+        fwrite(&tr, sizeof(tr), 1, fp);
+        fflush(fp);
+    }
+
+    /**
+     * Append raw bytes of a value or an array to a state buffer
+     */
+    template <typename T>
+    static void putState(std::vector<char> &state, const T *p, size_t n = 1)
+    {
+        const char *c = (const char *) p;
+        state.insert(state.end(), c, c + n * sizeof(T));
+    }
+
+    template <typename T>
+    static bool getState(
+        const std::vector<char> &state,
+        size_t &pos,
+        T *p,
+        size_t n = 1)
+    {
+        if (pos + n * sizeof(T) > state.size()) {
+            return false;
+        }
+        memcpy(p, &state[pos], n * sizeof(T));
+        pos += n * sizeof(T);
+        return true;
+    }
+
+    void DeltaWriter::saveState(std::vector<char> &state) const
+    {
+        state.clear();
+        uint64_t numBlocks = blockOffsets.size();
+        uint64_t blockSize = block.size();
+        putState(state, &numRows);
+        putState(state, &offset);
+        putState(state, &numBlocks);
+        putState(state, blockOffsets.data(), numBlocks);
+        putState(state, &blockRowCount);
+        putState(state, &blockSize);
+        putState(state, block.data(), blockSize);
+        putState(state, prev.data(), prev.size());
+        putState(state, &prevTime);
+    }
+
+    bool DeltaWriter::restoreState(const std::vector<char> &state)
+    {
+        size_t pos = 0;
+        uint64_t numBlocks, blockSize;
+        if (!(getState(state, pos, &numRows) &&
+              getState(state, pos, &offset) &&
+              getState(state, pos, &numBlocks) &&
+              numBlocks <= state.size()))
+        {
+            return false;
+        }
+        blockOffsets.resize(numBlocks);
+        if (!(getState(state, pos, blockOffsets.data(), numBlocks) &&
+              getState(state, pos, &blockRowCount) &&
+              getState(state, pos, &blockSize) &&
+              blockSize <= state.size()))
+        {
+            return false;
+        }
+        block.resize(blockSize);
+        return
+            getState(state, pos, block.data(), blockSize) &&
+            getState(state, pos, prev.data(), prev.size()) &&
+            getState(state, pos, &prevTime) &&
+            pos == state.size();
+    }
+
+    SparseWriter::SparseWriter(
+        FILE *fp,
+        const std::vector<string> &names,
+        double plotInterval,
+        uint32_t deadband,
+        double maxGap)
+        : BinWriter(fp, names, plotInterval),
+          deadband(deadband),
+          maxGap(maxGap),
+          haveLast(0),
+          last(counts.size(), 0),
+          lastTime(0.0),
+          pending(0),
+          held(counts.size(), 0),
+          heldTime(0.0)
+    {}
+
+    void SparseWriter::writeHeader()
+    {
+        writeFileHeader(SPARSE_MAGIC, 0);
+    }
+
+    void SparseWriter::writeRow(double time)
+    {
+        // Plot times accumulate rounding errors, so allow for those
+        // in the gap
+        //
+        bool write = !haveLast ||
+            (maxGap > 0.0 && time - lastTime >= maxGap - 1e-6 * plotInterval);
+        for (uint c = 0; c < counts.size() && !write; c++) {
+            write = (counts[c] > last[c] ? counts[c] - last[c]
+                                         : last[c] - counts[c]) > deadband;
+        }
+
+        if (write) {
+            BinWriter::writeRow(time);
+            last = counts;
+            lastTime = time;
+            haveLast = 1;
+            pending = 0;
+        } else {
+            held = counts;
+            heldTime = time;
+            pending = 1;
+        }
+    }
+
+    void SparseWriter::finish()
+    {
+        if (pending) {
+            counts = held;
+            BinWriter::writeRow(heldTime);
+            pending = 0;
+        }
+        BinWriter::finish();
+    }
+
+    void SparseWriter::saveState(std::vector<char> &state) const
+    {
+        state.clear();
+        putState(state, &haveLast);
+        putState(state, last.data(), last.size());
+        putState(state, &lastTime);
+        putState(state, &pending);
+        putState(state, held.data(), held.size());
+        putState(state, &heldTime);
+    }
+
+    bool SparseWriter::restoreState(const std::vector<char> &state)
+    {
+        size_t pos = 0;
+        return
+            getState(state, pos, &haveLast) &&
+            getState(state, pos, last.data(), last.size()) &&
+            getState(state, pos, &lastTime) &&
+            getState(state, pos, &pending) &&
+            getState(state, pos, held.data(), held.size()) &&
+            getState(state, pos, &heldTime) &&
+            pos == state.size();
+    }
+
+    EnsembleWriter::EnsembleWriter(
+        const string &fileName,
+        uint run,
+        uint numRuns,
+        uint numTimes,
+        const std::vector<string> &names,
+        double plotInterval)
+        : Writer(NULL, names, plotInterval),
+          fileName(fileName),
+          run(run),
+          numRuns(numRuns),
+          numTimes(numTimes),
+          rowCount(0),
+          series(counts.size() * numTimes, 0)
+    {}
+
+    void EnsembleWriter::writeHeader()
+    {
+        const char *fname = fileName.c_str();
+
+        // Everything up to the done flags is the same for all runs
+        //
+        std::vector<char> block;
+        for (uint i = 1; i < names.size(); i++) {
+            block.insert(block.end(), names[i].begin(), names[i].end());
+            block.push_back('\0');
+        }
+        block.resize(pad8(block.size()), '\0');
+
+        uint numSpecies = counts.size();
+        EnsembleLayout layout(block.size(), numSpecies, numRuns, numTimes);
+
+        std::vector<char> hdr(layout.done, '\0');
+        EnsembleHeader eh;
+        memset(&eh, 0, sizeof(eh));
+        memcpy(eh.magic, ENSEMBLE_MAGIC, sizeof(eh.magic));
+        eh.version      = VERSION;
+        eh.numSpecies   = numSpecies;
+        eh.numRuns      = numRuns;
+        eh.numTimes     = numTimes;
+        eh.plotInterval = plotInterval;
+        eh.namesSize    = block.size();
+        memcpy(&hdr[0], &eh, sizeof(eh));
+        memcpy(&hdr[layout.names], block.data(), block.size());
+
+        for (uint s = 0; s < numSpecies; s++) {
+            uint64_t off = layout.data + s * layout.speciesSize;
+            memcpy(&hdr[layout.directory + s * sizeof(off)], &off, sizeof(off));
+        }
+        double t = 0.0;  // accumulated the way plot times are
+        for (uint i = 0; i < numTimes; i++, t += plotInterval) {
+            memcpy(&hdr[layout.times + i * sizeof(t)], &t, sizeof(t));
+        }
+
+        // The first run to get here creates the store
+        //
+        int fd = ::open(fname, O_RDWR | O_CREAT, 0666);
+        if (fd < 0) {
+            perror(fname);
+            exit(1);
+        }
+        flock(fd, LOCK_EX);
+
+        struct stat st;
+        if (fstat(fd, &st) != 0) {
+            perror(fname);
+            exit(1);
+        }
+        if (st.st_size == 0) {
+            if (pwrite(fd, hdr.data(), hdr.size(), 0) != (ssize_t) hdr.size() ||
+                ftruncate(fd, layout.total) != 0)
+            {
+                perror(fname);
+                exit(1);
+            }
+        } else {
+            std::vector<char> existing(hdr.size());
+            if (pread(fd, existing.data(), existing.size(), 0) !=
+                    (ssize_t) existing.size() ||
+                existing != hdr ||
+                st.st_size != (off_t) layout.total)
+            {
+                fmt::print(stderr, "{}: ensemble store has different "
+                           "species, runs, times or plot interval\n", fname);
+                exit(1);
+            }
+        }
+
+        flock(fd, LOCK_UN);
+        close(fd);
+    }
+
+    void EnsembleWriter::writeRow(double time)
+    {
+        if (rowCount < numTimes) {
+            for (uint s = 0; s < counts.size(); s++) {
+                series[(size_t) s * numTimes + rowCount] = counts[s];
+            }
+            rowCount++;
+        }
+    }
+
+    void EnsembleWriter::finish()
+    {
+        const char *fname = fileName.c_str();
+
+        // A run that ended early stays in its final state
+        //
+        for (uint s = 0; s < counts.size(); s++) {
+            uint32_t *p = &series[(size_t) s * numTimes];
+            for (uint i = rowCount; i < numTimes; i++) {
+                p[i] = (i == 0 ? 0 : p[i - 1]);
+            }
+        }
+
+        int fd = ::open(fname, O_RDWR);
+        if (fd < 0) {
+            perror(fname);
+            exit(1);
+        }
+        EnsembleHeader eh;
+        if (pread(fd, &eh, sizeof(eh), 0) != sizeof(eh)) {
+            perror(fname);
+            exit(1);
+        }
+        EnsembleLayout layout(eh.namesSize, counts.size(), numRuns, numTimes);
+
+        size_t len = numTimes * sizeof(uint32_t);
+        for (uint s = 0; s < counts.size(); s++) {
+            off_t off = layout.data + s * layout.speciesSize + run * len;
+            if (pwrite(fd, &series[(size_t) s * numTimes], len, off) !=
+                (ssize_t) len)
+            {
+                perror(fname);
+                exit(1);
+            }
+        }
+        uint8_t done = 1;
+        if (pwrite(fd, &done, 1, layout.done + run) != 1) {
+            perror(fname);
+            exit(1);
+        }
+        close(fd);
+    }
+
+    void EnsembleWriter::saveState(std::vector<char> &state) const
+    {
+        state.clear();
+        uint32_t nameLen = fileName.size();
+        putState(state, &nameLen);
+        putState(state, fileName.data(), nameLen);
+        putState(state, &run);
+        putState(state, &numRuns);
+        putState(state, &numTimes);
+        putState(state, &rowCount);
+        putState(state, series.data(), series.size());
+    }
+
+    bool EnsembleWriter::restoreState(const std::vector<char> &state)
+    {
+        size_t pos = 0;
+        uint32_t nameLen;
+        if (!getState(state, pos, &nameLen) || nameLen > state.size()) {
+            return false;
+        }
+        fileName.resize(nameLen);
+        if (!(getState(state, pos, &fileName[0], nameLen) &&
+              getState(state, pos, &run) &&
+              getState(state, pos, &numRuns) &&
+              getState(state, pos, &numTimes) &&
+              getState(state, pos, &rowCount) &&
+              (size_t) counts.size() * numTimes <= state.size()))
+        {
+            return false;
+        }
+        series.resize((size_t) counts.size() * numTimes);
+        return
+            getState(state, pos, series.data(), series.size()) &&
+            pos == state.size();
+    }
+
+    EventWriter::EventWriter(
+        FILE *fp,
+        const std::vector<string> &names,
+        double plotInterval,
+        const std::vector<std::vector<int>> &deltas)
+        : Writer(fp, names, plotInterval),
+          deltas(deltas),
+          changesCounts(deltas.size(), false),
+          endTime(0.0)
+    {
+        for (uint r = 0; r < deltas.size(); r++) {
+            for (int d : deltas[r]) {
+                if (d != 0) {
+                    changesCounts[r] = true;
+                }
+            }
+        }
+    }
+
+    void EventWriter::writeHeader()
+    {
+        writeFileHeader(EVENT_MAGIC, 0);
+
+        uint32_t numReactions = deltas.size();
+        fwrite(&numReactions, sizeof(numReactions), 1, fp);
+        for (auto &d : deltas) {
+            std::vector<int32_t> row(d.begin(), d.end());
+            fwrite(row.data(), sizeof(int32_t), row.size(), fp);
+        }
+        fwrite(counts.data(), sizeof(uint32_t), counts.size(), fp);
+    }
+
+    void EventWriter::logSetInhib(double time, uint reaction, double level)
+    {
+        putVarint(2);
+        putVarint(reaction);
+        fwrite(&level, sizeof(level), 1, fp);
+        putTime(time);
+    }
+
+    void EventWriter::finish()
+    {
+        putVarint(0);
+        putTime(endTime);
+        fflush(fp);
+    }
+
+    StatsWriter::StatsWriter(
+        FILE *fp,
+        const std::vector<string> &names,
+        double plotInterval)
+        : Writer(fp, names, plotInterval),
+          numRows(0),
+          sum(counts.size(), 0.0),
+          sumSq(counts.size(), 0.0),
+          min(counts.size(), UINT32_MAX),
+          max(counts.size(), 0)
+    {}
+
+    void StatsWriter::writeRow(double time)
+    {
+        numRows++;
+        for (uint c = 0; c < counts.size(); c++) {
+            uint32_t v = counts[c];
+            sum[c] += v;
+            sumSq[c] += (double) v * v;
+            min[c] = std::min(min[c], v);
+            max[c] = std::max(max[c], v);
+        }
+    }
+
+    double StatsWriter::getMean(uint col) const
+    {
+        return numRows == 0 ? 0.0 : sum[col] / numRows;
+    }
+
+    double StatsWriter::getStdev(uint col) const
+    {
+        if (numRows == 0) {
+            return 0.0;
+        }
+        double mean = getMean(col);
+        return sqrt(std::max(0.0, sumSq[col] / numRows - mean * mean));
+    }
+
+    void StatsWriter::finish()
+    {
+        uint width = 8;
+        for (uint c = 0; c < counts.size(); c++) {
+            width = std::max(width, (uint) names[c + 1].size() + 1);
+        }
+        fmt::print(fp, "{:>{}}{:>12}{:>12}{:>12}{:>12}\n",
+                   "species", width, "mean", "stdev", "min", "max");
+        for (uint c = 0; c < counts.size(); c++) {
+            fmt::print(fp, "{:>{}}{:12.4f}{:12.4f}{:12}{:12}\n",
+                       names[c + 1], width, getMean(c), getStdev(c),
+                       numRows == 0 ? 0 : min[c], max[c]);
+        }
+        fflush(fp);
+    }
+
+    void StatsWriter::saveState(std::vector<char> &state) const
+    {
+        state.clear();
+        putState(state, &numRows);
+        putState(state, sum.data(), sum.size());
+        putState(state, sumSq.data(), sumSq.size());
+        putState(state, min.data(), min.size());
+        putState(state, max.data(), max.size());
+    }
+
+    bool StatsWriter::restoreState(const std::vector<char> &state)
+    {
+        size_t pos = 0;
+        return
+            getState(state, pos, &numRows) &&
+            getState(state, pos, sum.data(), sum.size()) &&
+            getState(state, pos, sumSq.data(), sumSq.size()) &&
+            getState(state, pos, min.data(), min.size()) &&
+            getState(state, pos, max.data(), max.size()) &&
+            pos == state.size();
+    }
+
+    ErgodicWriter::ErgodicWriter(
+        FILE *fp,
+        const std::vector<string> &names,
+        double plotInterval,
+        double burnIn,
+        double endTime,
+        uint numBatches)
+        : Writer(fp, names, plotInterval),
+          burnIn(burnIn),
+          endTime(endTime),
+          numBatches(numBatches),
+          lastTime(-DBL_MAX),
+          last(counts.size(), 0),
+          area(counts.size(), 0.0),
+          areaSq(counts.size(), 0.0),
+          batchArea(numBatches * counts.size(), 0.0),
+          batchTime(numBatches, 0.0),
+          hist(counts.size())
+    {}
+
+    void ErgodicWriter::writeRow(double time)
+    {
+        add(std::max(lastTime, burnIn), std::min(time, endTime));
+        lastTime = time;
+        last = counts;
+    }
+
+    void ErgodicWriter::add(double from, double to)
+    {
+        if (lastTime == -DBL_MAX) {
+            return;
+        }
+        double batchLen = (endTime - burnIn) / numBatches;
+        while (from < to) {
+            uint b = std::min((uint) ((from - burnIn) / batchLen),
+                              numBatches - 1);
+            double until = b == numBatches - 1
+                ? to : std::min(to, burnIn + (b + 1) * batchLen);
+            double dt = until - from;
+            batchTime[b] += dt;
+            for (uint c = 0; c < counts.size(); c++) {
+                uint32_t v = last[c];
+                area[c] += v * dt;
+                areaSq[c] += (double) v * v * dt;
+                batchArea[b * counts.size() + c] += v * dt;
+                if (v >= hist[c].size()) {
+                    hist[c].resize(v + 1, 0.0);
+                }
+                hist[c][v] += dt;
+            }
+            from = until;
+        }
+    }
+
+    void ErgodicWriter::finish()
+    {
+        // The last row's counts hold until the end of the run
+        add(std::max(lastTime, burnIn), endTime);
+
+        uint width = 8;
+        for (uint c = 0; c < counts.size(); c++) {
+            width = std::max(width, (uint) names[c + 1].size() + 1);
+        }
+        double total = 0.0;
+        uint nb = 0;
+        for (auto bt : batchTime) {
+            total += bt;
+            nb += bt > 0.0 ? 1 : 0;
+        }
+
+        fmt::print(fp, "{:>{}}{:>12}{:>12}{:>12}\n",
+                   "species", width, "mean", "stdev", "ci95");
+        for (uint c = 0; c < counts.size(); c++) {
+            double mean = total > 0.0 ? area[c] / total : 0.0;
+            double var = total > 0.0 ? areaSq[c] / total - mean * mean : 0.0;
+
+            // Confidence interval half width from the batch means
+            double sumSq = 0.0;
+            for (uint b = 0; b < numBatches; b++) {
+                if (batchTime[b] > 0.0) {
+                    double d = batchArea[b * counts.size() + c] /
+                        batchTime[b] - mean;
+                    sumSq += d * d;
+                }
+            }
+            double ci = nb > 1
+                ? Util::tQuantile(nb - 1) * sqrt(sumSq / (nb - 1) / nb) : NAN;
+            fmt::print(fp, "{:>{}}{:12.4f}{:12.4f}{:12.4f}\n",
+                       names[c + 1], width, mean, sqrt(std::max(0.0, var)),
+                       ci);
+        }
+        for (uint c = 0; c < counts.size(); c++) {
+            fmt::print(fp, "\n{:>{}}{:>12}\n", names[c + 1], width,
+                       "fraction");
+            for (uint v = 0; v < hist[c].size(); v++) {
+                if (hist[c][v] > 0.0) {
+                    fmt::print(fp, "{:>{}}{:12.6f}\n", v, width,
+                               hist[c][v] / total);
+                }
+            }
+        }
+        fflush(fp);
+    }
+
+    void ErgodicWriter::saveState(std::vector<char> &state) const
+    {
+        state.clear();
+        putState(state, &lastTime);
+        putState(state, last.data(), last.size());
+        putState(state, area.data(), area.size());
+        putState(state, areaSq.data(), areaSq.size());
+        putState(state, batchArea.data(), batchArea.size());
+        putState(state, batchTime.data(), batchTime.size());
+        for (auto &h : hist) {
+            uint64_t n = h.size();
+            putState(state, &n);
+            putState(state, h.data(), n);
+        }
+    }
+
+    bool ErgodicWriter::restoreState(const std::vector<char> &state)
+    {
+        size_t pos = 0;
+        bool ok =
+            getState(state, pos, &lastTime) &&
+            getState(state, pos, last.data(), last.size()) &&
+            getState(state, pos, area.data(), area.size()) &&
+            getState(state, pos, areaSq.data(), areaSq.size()) &&
+            getState(state, pos, batchArea.data(), batchArea.size()) &&
+            getState(state, pos, batchTime.data(), batchTime.size());
+        for (auto &h : hist) {
+            uint64_t n;
+            if (!ok || !getState(state, pos, &n) || n > (1 << 24)) {
+                return false;
+            }
+            h.resize(n);
+            ok = getState(state, pos, h.data(), n);
+        }
+        return ok && pos == state.size();
+    }
+
+    AsyncWriter::AsyncWriter(
+        const std::vector<Writer *> &sinks,
+        const std::vector<string> &names,
+        double plotInterval,
+        bool threaded)
+        : Writer(NULL, names, plotInterval),
+          sinks(sinks),
+          threaded(threaded),
+          slotSize(sizeof(double) + counts.size() * sizeof(uint32_t)),
+          ring(threaded ? RING_ROWS * slotSize : 0),
+          head(0),
+          tail(0),
+          waiting(false),
+          stopping(false)
+    {
+        if (!threaded) {
+            return;
+        }
+        pthread_mutex_init(&mutex, NULL);
+        pthread_cond_init(&cond, NULL);
+        int ret = pthread_create(&thread, NULL, threadMain, this);
+        ABORT_IF(ret != 0, "pthread_create returned %d", ret);
+    }
+
+    AsyncWriter::~AsyncWriter()
+    {
+        if (threaded) {
+            sync();
+            stopping = true;
+            wake();
+            pthread_join(thread, NULL);
+            pthread_cond_destroy(&cond);
+            pthread_mutex_destroy(&mutex);
+        }
+        for (auto s : sinks) {
+            delete s;
+        }
+    }
+
+    void *AsyncWriter::threadMain(void *arg)
+    {
+        ((AsyncWriter *) arg)->consume();
+        return NULL;
+    }
+
+    /**
+     * Consumer thread: pass rows on to the sinks until stopped. When the
+     * ring is empty, sleep until the producer wakes us. The producer
+     * checks `waiting' after publishing rows, and we check `tail' after
+     * setting `waiting', so that one of us sees the other's update.
+     */
+    void AsyncWriter::consume()
+    {
+        uint64_t h = head.load(std::memory_order_relaxed);
+        for (;;) {
+            uint64_t t = tail.load(std::memory_order_acquire);
+            if (h == t) {
+                if (stopping) {
+                    break;
+                }
+                pthread_mutex_lock(&mutex);
+                waiting = true;
+                if (tail == h && !stopping) {
+                    pthread_cond_wait(&cond, &mutex);
+                }
+                waiting = false;
+                pthread_mutex_unlock(&mutex);
+                continue;
+            }
+            for (; h != t; h++) {
+                const char *slot = &ring[(h % RING_ROWS) * slotSize];
+                double time;
+                memcpy(&time, slot, sizeof(time));
+                const uint32_t *rowCounts =
+                    (const uint32_t *) (slot + sizeof(time));
+                for (auto s : sinks) {
+                    for (uint c = 0; c < counts.size(); c++) {
+                        s->setCount(c, rowCounts[c]);
+                    }
+                    s->writeRow(time);
+                }
+                head.store(h + 1, std::memory_order_release);
+            }
+        }
+    }
+
+    void AsyncWriter::wake()
+    {
+        pthread_mutex_lock(&mutex);
+        pthread_cond_signal(&cond);
+        pthread_mutex_unlock(&mutex);
+    }
+
+    void AsyncWriter::writeRow(double time)
+    {
+        if (!threaded) {
+            for (auto s : sinks) {
+                for (uint c = 0; c < counts.size(); c++) {
+                    s->setCount(c, counts[c]);
+                }
+                s->writeRow(time);
+            }
+            return;
+        }
+
+        uint64_t t = tail.load(std::memory_order_relaxed);
+        while (t - head.load(std::memory_order_acquire) == RING_ROWS) {
+            // Ring full: wait for the consumer
+            //
+            if (waiting) {
+                wake();
+            }
+            sched_yield();
+        }
+        char *slot = &ring[(t % RING_ROWS) * slotSize];
+        memcpy(slot, &time, sizeof(time));
+        memcpy(slot + sizeof(time), counts.data(),
+               counts.size() * sizeof(uint32_t));
+        tail = t + 1;
+
+        // Wake the consumer once a batch of rows is waiting, rather than
+        // for every row (sync() wakes it for the rest)
+        //
+        if (waiting &&
+            t + 1 - head.load(std::memory_order_relaxed) >= RING_ROWS / 4)
+        {
+            wake();
+        }
+    }
+
+    void AsyncWriter::sync()
+    {
+        while (head.load(std::memory_order_acquire) !=
+               tail.load(std::memory_order_relaxed))
+        {
+            if (waiting) {
+                wake();
+            }
+            sched_yield();
+        }
+    }
+
+    void AsyncWriter::setFile(FILE *fp)
+    {
+        sync();
+        if (!sinks.empty()) {
+            sinks[0]->setFile(fp);
+        }
+    }
+
+    void AsyncWriter::writeHeader()
+    {
+        sync();
+        for (auto s : sinks) {
+            for (uint c = 0; c < counts.size(); c++) {
+                s->setCount(c, counts[c]);
+            }
+            s->writeHeader();
+        }
+    }
+
+    void AsyncWriter::finish()
+    {
+        sync();
+        for (auto s : sinks) {
+            s->finish();
+        }
+    }
+
+    /**
+     * The state is that of each sink, preceded by its size. Only valid
+     * after sync().
+     */
+    void AsyncWriter::saveState(std::vector<char> &state) const
+    {
+        state.clear();
+        std::vector<char> sinkState;
+        for (auto s : sinks) {
+            s->saveState(sinkState);
+            uint64_t size = sinkState.size();
+            putState(state, &size);
+            putState(state, sinkState.data(), size);
+        }
+    }
+
+    bool AsyncWriter::restoreState(const std::vector<char> &state)
+    {
+        sync();
+        size_t pos = 0;
+        for (auto s : sinks) {
+            uint64_t size;
+            if (!getState(state, pos, &size) || size > state.size() - pos) {
+                return false;
+            }
+            std::vector<char> sinkState(
+                state.begin() + pos, state.begin() + pos + size);
+            pos += size;
+            if (!s->restoreState(sinkState)) {
+                return false;
+            }
+        }
+        return pos == state.size();
+    }
+
+    // ------------------------------------------------------------------
+    // Readers
+    // ------------------------------------------------------------------
+
+    Reader::Reader()
+        : numCounts(0),
+          numRows(0),
+          plotInterval(0.0),
+          blockRows(0),
+          data(NULL),
+          size(0),
+          headerSize(0),
+          mapAddr(NULL),
+          mapSize(0)
+    {}
+
+    Reader::~Reader()
+    {
+        if (mapAddr != NULL) {
+            munmap(mapAddr, mapSize);
+        }
+    }
+
+    /**
+     * Map or read the file
+     */
+    bool Reader::load(const char *fname, FILE *fp, string &errMsg)
+    {
+        struct stat st;
+        if (fstat(fileno(fp), &st) == 0 && S_ISREG(st.st_mode) &&
+            st.st_size > 0)
+        {
+            mapSize = st.st_size;
+            mapAddr = mmap(NULL, mapSize, PROT_READ, MAP_PRIVATE,
+                           fileno(fp), 0);
+            if (mapAddr == MAP_FAILED) {
+                mapAddr = NULL;
+                errMsg = fmt::format("{}: {}", fname, strerror(errno));
+                return false;
+            }
+            madvise(mapAddr, mapSize, MADV_SEQUENTIAL);
+            data = (const char *) mapAddr;
+            size = mapSize;
+        } else {
+            char chunk[65536];
+            size_t n;
+            while ((n = fread(chunk, 1, sizeof(chunk), fp)) > 0) {
+                buf.insert(buf.end(), chunk, chunk + n);
+            }
+            data = buf.data();
+            size = buf.size();
+        }
+        if (size < sizeof(BIN_MAGIC)) {
+            errMsg = fmt::format("{}: truncated header", fname);
+            return false;
+        }
+        return true;
+    }
+
+    bool Reader::parseHeader(const char *fname, string &errMsg)
+    {
+        FileHeader hdr;
+        if (size < sizeof(hdr)) {
+            errMsg = fmt::format("{}: truncated header", fname);
+            return false;
+        }
+        memcpy(&hdr, data, sizeof(hdr));
+        if (hdr.version != VERSION) {
+            errMsg = fmt::format("{}: unsupported version {}",
+                                 fname, hdr.version);
+            return false;
+        }
+        headerSize = sizeof(hdr) + hdr.namesSize;
+        if (size < headerSize) {
+            errMsg = fmt::format("{}: truncated header", fname);
+            return false;
+        }
+
+        names.clear();
+        const char *p = data + sizeof(hdr);
+        const char *end = data + headerSize;
+        while (p < end && *p != '\0' && names.size() < hdr.numCounts + 1) {
+            size_t len = strnlen(p, end - p);
+            names.push_back(string(p, len));
+            p += len + 1;
+        }
+        if (names.size() != hdr.numCounts + 1) {
+            errMsg = fmt::format("{}: bad column names", fname);
+            return false;
+        }
+
+        numCounts = hdr.numCounts;
+        numRows = hdr.numRows;
+        plotInterval = hdr.plotInterval;
+        blockRows = hdr.blockRows;
+        return true;
+    }
+
+    bool BinReader::parse(const char *fname, string &errMsg)
+    {
+        rowSize = pad8(sizeof(double) + numCounts * sizeof(uint32_t));
+        rows = data + headerSize;
+
+        // The row count in the header is 0 if the writer could not seek
+        // back to it, or was interrupted. Rows present in the file count.
+        //
+        uint64_t present = (size - headerSize) / rowSize;
+        if (numRows == 0 || numRows > present) {
+            numRows = present;
+        }
+        return true;
+    }
+
+    double BinReader::getRow(uint64_t row, uint32_t *counts)
+    {
+        memcpy(counts, getCounts(row), numCounts * sizeof(uint32_t));
+        return getTime(row);
+    }
+
+    bool SparseReader::parse(const char *fname, string &errMsg)
+    {
+        if (!BinReader::parse(fname, errMsg)) {
+            return false;
+        }
+        numStored = numRows;
+        setGrid(plotInterval);
+        return true;
+    }
+
+    bool SparseReader::setGrid(double interval)
+    {
+        grid.clear();
+        tolerance = 1e-6 * interval;
+        if (numStored == 0) {
+            // No rows at all
+        } else if (interval > 0.0) {
+            double endTime = getTime(numStored - 1);
+            for (double t = 0.0; t <= endTime + tolerance; t += interval) {
+                grid.push_back(t);
+            }
+        } else {
+            for (uint64_t r = 0; r < numStored; r++) {
+                grid.push_back(getTime(r));
+            }
+        }
+        numRows = grid.size();
+        cur = 0;
+        return true;
+    }
+
+    double SparseReader::getRow(uint64_t row, uint32_t *counts)
+    {
+        ABORT_IF(row >= numRows, "Row out of range");
+
+        // Find the last stored row at or before the grid time
+        //
+        double p = grid[row];
+        if (getTime(cur) > p + tolerance) {
+            cur = 0;
+        }
+        while (cur + 1 < numStored && getTime(cur + 1) <= p + tolerance) {
+            cur++;
+        }
+
+        memcpy(counts, getCounts(cur), numCounts * sizeof(uint32_t));
+        return p;
+    }
+
+    bool DeltaReader::parse(const char *fname, string &errMsg)
+    {
+        // Use the block index, if there is a valid one
+        //
+        Trailer tr;
+        bool indexed = false;
+        if (size >= headerSize + sizeof(tr)) {
+            memcpy(&tr, data + size - sizeof(tr), sizeof(tr));
+            indexed =
+                memcmp(tr.magic, INDEX_MAGIC, sizeof(tr.magic)) == 0 &&
+                tr.numBlocks <= (size - headerSize - sizeof(tr)) / 8;
+        }
+        if (indexed) {
+            const char *idx = data + size - sizeof(tr) - tr.numBlocks * 8;
+            blockOffsets.resize(tr.numBlocks);
+            memcpy(blockOffsets.data(), idx, tr.numBlocks * 8);
+        }
+
+        // Walk the blocks, using their headers. This checks the index,
+        // and locates the blocks if there is none.
+        //
+        numRows = 0;
+        size_t off = headerSize;
+        for (uint b = 0; !indexed || b < blockOffsets.size(); b++) {
+            if (indexed) {
+                off = blockOffsets[b];
+            }
+            BlockHeader bh;
+            if (off + sizeof(bh) > size) {
+                if (indexed) {
+                    errMsg = fmt::format("{}: bad block index", fname);
+                    return false;
+                }
+                break;
+            }
+            memcpy(&bh, data + off, sizeof(bh));
+            if (bh.numRows == 0 || off + sizeof(bh) + bh.numBytes > size) {
+                if (indexed) {
+                    errMsg = fmt::format("{}: bad block index", fname);
+                    return false;
+                }
+                break;  // truncated
+            }
+            if (!indexed) {
+                blockOffsets.push_back(off);
+            }
+            blockFirstRows.push_back(numRows);
+            numRows += bh.numRows;
+            off += sizeof(bh) + bh.numBytes;
+        }
+
+        cur.resize(numCounts);
+        curBlock = UINT32_MAX;
+        curRow = 0;
+        pos = blockEnd = NULL;
+        curTime = 0.0;
+        return true;
+    }
+
+    uint64_t DeltaReader::getVarint()
+    {
+        uint64_t v = 0;
+        for (uint shift = 0; ; shift += 7) {
+            ABORT_IF(pos >= blockEnd, "Corrupt delta trajectory block");
+            uint8_t b = *pos++;
+            v |= (uint64_t) (b & 0x7f) << shift;
+            if ((b & 0x80) == 0) {
+                return v;
+            }
+        }
+    }
+
+    void DeltaReader::seekBlock(uint b)
+    {
+        BlockHeader bh;
+        memcpy(&bh, data + blockOffsets[b], sizeof(bh));
+        pos = (const uint8_t *) data + blockOffsets[b] + sizeof(bh);
+        blockEnd = pos + bh.numBytes;
+        curBlock = b;
+        curRow = blockFirstRows[b];
+        std::fill(cur.begin(), cur.end(), 0);
+    }
+
+    void DeltaReader::decodeRow()
+    {
+        if (getVarint() == 0) {
+            curTime += plotInterval;
+        } else {
+            ABORT_IF(pos + sizeof(double) > blockEnd,
+                     "Corrupt delta trajectory block");
+            memcpy(&curTime, pos, sizeof(double));
+            pos += sizeof(double);
+        }
+
+        uint64_t numChanged = getVarint();
+        uint64_t c = 0;
+        for (uint64_t i = 0; i < numChanged; i++) {
+            c += getVarint();
+            ABORT_IF(c >= numCounts, "Corrupt delta trajectory block");
+            cur[c] += (uint32_t) unzigzag(getVarint());
+            c++;
+        }
+        curRow++;
+    }
+
+    double DeltaReader::getRow(uint64_t row, uint32_t *counts)
+    {
+        ABORT_IF(row >= numRows, "Row out of range");
+
+        // Unless the row is further on in the current block, start
+        // decoding at the beginning of the block that contains it
+        //
+        uint b = std::upper_bound(blockFirstRows.begin(),
+                                  blockFirstRows.end(), row) -
+                 blockFirstRows.begin() - 1;
+        if (b != curBlock || row < curRow) {
+            seekBlock(b);
+        }
+        while (curRow <= row) {
+            decodeRow();
+        }
+        memcpy(counts, cur.data(), numCounts * sizeof(uint32_t));
+        return curTime;
+    }
+
+    bool EventReader::parse(const char *fname, string &errMsg)
+    {
+        const char *p = data + headerSize;
+        uint32_t n;
+        if (p + sizeof(n) > data + size) {
+            errMsg = fmt::format("{}: truncated header", fname);
+            return false;
+        }
+        memcpy(&n, p, sizeof(n));
+        p += sizeof(n);
+        numReactions = n;
+
+        size_t tableSize = (size_t) (numReactions + 1) * numCounts * 4;
+        if (p + tableSize > data + size) {
+            errMsg = fmt::format("{}: truncated header", fname);
+            return false;
+        }
+        deltas.resize((size_t) numReactions * numCounts);
+        memcpy(deltas.data(), p, deltas.size() * sizeof(int32_t));
+        p += deltas.size() * sizeof(int32_t);
+        initial.resize(numCounts);
+        memcpy(initial.data(), p, numCounts * sizeof(uint32_t));
+        p += numCounts * sizeof(uint32_t);
+
+        first = (const uint8_t *) p;
+        end = (const uint8_t *) data + size;
+
+        // Find the end time
+        //
+        endTime = 0.0;
+        const uint8_t *q = first;
+        uint64_t tag, a, b;
+        double time;
+        while (decode(q, tag, a, b, time)) {
+            if (tag >= 3 && tag - 3 >= numReactions) {
+                errMsg = fmt::format("{}: bad reaction number", fname);
+                return false;
+            }
+            if (tag == 1 && a >= numCounts) {
+                errMsg = fmt::format("{}: bad column number", fname);
+                return false;
+            }
+            endTime = time;
+            if (tag == 0) {
+                break;
+            }
+        }
+
+        cur.resize(numCounts);
+        setGrid(plotInterval);
+        return true;
+    }
+
+    bool EventReader::decode(
+        const uint8_t *&p,
+        uint64_t &tag,
+        uint64_t &a,
+        uint64_t &b,
+        double &time) const
+    {
+        const uint8_t *q = p;
+        auto varint = [&](uint64_t &v) {
+            v = 0;
+            for (uint shift = 0; q < end; shift += 7) {
+                uint8_t c = *q++;
+                v |= (uint64_t) (c & 0x7f) << shift;
+                if ((c & 0x80) == 0) {
+                    return true;
+                }
+            }
+            return false;
+        };
+        auto dble = [&](double &d) {
+            if (q + sizeof(d) > end) {
+                return false;
+            }
+            memcpy(&d, q, sizeof(d));
+            q += sizeof(d);
+            return true;
+        };
+
+        double level;
+        if (!varint(tag)) {
+            return false;
+        }
+        if (tag == 1) {
+            if (!varint(a) || !varint(b)) {
+                return false;
+            }
+        } else if (tag == 2) {
+            if (!varint(a) || !dble(level)) {
+                return false;
+            }
+        }
+        if (!dble(time)) {
+            return false;
+        }
+        p = q;
+        return true;
+    }
+
+    bool EventReader::setGrid(double interval)
+    {
+        grid.clear();
+        if (interval > 0.0) {
+            for (double t = 0.0; t <= endTime; t += interval) {
+                grid.push_back(t);
+            }
+        } else {
+            // A row at the start, and one before each reaction
+            grid.push_back(0.0);
+            const uint8_t *q = first;
+            uint64_t tag, a, b;
+            double time;
+            while (decode(q, tag, a, b, time) && tag != 0) {
+                if (tag >= 3 && time <= endTime && time > grid.back()) {
+                    grid.push_back(time);
+                }
+            }
+        }
+        numRows = grid.size();
+        rewind();
+        return true;
+    }
+
+    void EventReader::rewind()
+    {
+        pos = first;
+        cur = initial;
+        curRow = 0;
+    }
+
+    double EventReader::getRow(uint64_t row, uint32_t *counts)
+    {
+        ABORT_IF(row >= numRows, "Row out of range");
+        if (row < curRow) {
+            rewind();
+        }
+
+        // Apply the records that precede the row's time
+        //
+        double p = grid[row];
+        uint64_t tag, a = 0, b = 0;
+        double time;
+        const uint8_t *q = pos;
+        while (decode(q, tag, a, b, time) && tag != 0 &&
+               (time < p || time == 0.0))
+        {
+            if (tag == 1) {
+                cur[a] = b;
+            } else if (tag >= 3) {
+                const int32_t *d = &deltas[(size_t) (tag - 3) * numCounts];
+                for (uint c = 0; c < numCounts; c++) {
+                    cur[c] += d[c];
+                }
+            }
+            pos = q;
+        }
+        curRow = row + 1;
+
+        memcpy(counts, cur.data(), numCounts * sizeof(uint32_t));
+        return p;
+    }
+
+    EnsembleReader::EnsembleReader()
+        : numRuns(0),
+          numTimes(0),
+          plotInterval(0.0),
+          speciesOffsets(NULL),
+          times(NULL),
+          done(NULL),
+          data(NULL),
+          size(0)
+    {}
+
+    EnsembleReader::~EnsembleReader()
+    {
+        if (data != NULL) {
+            munmap((void *) data, size);
+        }
+    }
+
+    bool EnsembleReader::open(const char *fname, string &errMsg)
+    {
+        int fd = ::open(fname, O_RDONLY);
+        struct stat st;
+        if (fd < 0 || fstat(fd, &st) != 0) {
+            errMsg = fmt::format("{}: {}", fname, strerror(errno));
+            return false;
+        }
+        size = st.st_size;
+        if (size < sizeof(EnsembleHeader)) {
+            close(fd);
+            errMsg = fmt::format("{}: not an ensemble store", fname);
+            return false;
+        }
+        void *addr = mmap(NULL, size, PROT_READ, MAP_SHARED, fd, 0);
+        close(fd);
+        if (addr == MAP_FAILED) {
+            errMsg = fmt::format("{}: {}", fname, strerror(errno));
+            return false;
+        }
+        data = (const char *) addr;
+
+        EnsembleHeader eh;
+        memcpy(&eh, data, sizeof(eh));
+        if (memcmp(eh.magic, ENSEMBLE_MAGIC, sizeof(eh.magic)) != 0) {
+            errMsg = fmt::format("{}: not an ensemble store", fname);
+            return false;
+        }
+        if (eh.version != VERSION) {
+            errMsg = fmt::format("{}: unsupported version {}",
+                                 fname, eh.version);
+            return false;
+        }
+        EnsembleLayout layout(
+            eh.namesSize, eh.numSpecies, eh.numRuns, eh.numTimes);
+        if (size < layout.total) {
+            errMsg = fmt::format("{}: truncated ensemble store", fname);
+            return false;
+        }
+
+        names.clear();
+        const char *p = data + layout.names;
+        const char *end = data + layout.directory;
+        while (p < end && *p != '\0' && names.size() < eh.numSpecies) {
+            size_t len = strnlen(p, end - p);
+            names.push_back(string(p, len));
+            p += len + 1;
+        }
+        if (names.size() != eh.numSpecies) {
+            errMsg = fmt::format("{}: bad species names", fname);
+            return false;
+        }
+
+        numRuns        = eh.numRuns;
+        numTimes       = eh.numTimes;
+        plotInterval   = eh.plotInterval;
+        speciesOffsets = (const uint64_t *) (data + layout.directory);
+        times          = (const double *) (data + layout.times);
+        done           = (const volatile uint8_t *) (data + layout.done);
+
+        for (uint s = 0; s < names.size(); s++) {
+            if (speciesOffsets[s] + layout.speciesSize > size) {
+                errMsg = fmt::format("{}: bad directory", fname);
+                return false;
+            }
+        }
+        return true;
+    }
+
+    int EnsembleReader::speciesIndex(const string &name) const
+    {
+        for (uint s = 0; s < names.size(); s++) {
+            if (names[s] == name) {
+                return s;
+            }
+        }
+        return -1;
+    }
+
+    uint EnsembleReader::timeIndex(double t) const
+    {
+        double tol = 1e-6 * plotInterval;
+        return std::lower_bound(times, times + numTimes, t - tol) - times;
+    }
+
+    Reader *openReader(const char *fname, FILE *fp, string &errMsg)
+    {
+        // Load the file, then hand its contents to a reader for the
+        // format given by the magic number
+        //
+        BinReader probe;
+        if (!probe.load(fname, fp, errMsg)) {
+            return NULL;
+        }
+
+        Reader *reader;
+        if (memcmp(probe.data, BIN_MAGIC, sizeof(BIN_MAGIC)) == 0) {
+            reader = new BinReader;
+        } else if (memcmp(probe.data, DELTA_MAGIC, sizeof(DELTA_MAGIC)) == 0) {
+            reader = new DeltaReader;
+        } else if (memcmp(probe.data, EVENT_MAGIC, sizeof(EVENT_MAGIC)) == 0) {
+            reader = new EventReader;
+        } else if (memcmp(probe.data, SPARSE_MAGIC, sizeof(SPARSE_MAGIC)) == 0) {
+            reader = new SparseReader;
+        } else {
+            errMsg = fmt::format("{}: not a trajectory file", fname);
+            return NULL;
+        }
+
+        reader->mapAddr = probe.mapAddr;
+        reader->mapSize = probe.mapSize;
+        reader->buf.swap(probe.buf);  // keeps the data where it is
+        reader->data = probe.data;
+        reader->size = probe.size;
+        probe.mapAddr = NULL;
+
+        if (!reader->parseHeader(fname, errMsg) ||
+            !reader->parse(fname, errMsg))
+        {
+            delete reader;
+            return NULL;
+        }
+        return reader;
+    }
+};